@@ -0,0 +1,148 @@
+// Microbenchmark for the ray/box slab test.
+//
+// Counts heap allocations per ray for the old vector-returning box test
+// (copied here), BoundingBox::intersect, which allocates nothing, and a full
+// Mesh::intersect through the KD tree.
+//
+// Usage: bench_box [mesh.obj] [num_rays]
+// Run from the build directory; the default mesh is the bunny.
+
+#include "Mesh.h"
+#include "Object3D.h"
+#include "Ray.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+
+static std::atomic<long> g_allocations(0);
+
+void *operator new(std::size_t size)
+{
+    g_allocations++;
+    void *p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+// What BoundingBox::intersect used to return: {tnear, tfar} on a hit,
+// empty on a miss, allocating the vector on every hit.
+static std::vector<float>
+intersectVector(const BoundingBox &box, const Ray &r)
+{
+    float tnear, tfar;
+    if (!box.intersect(r, tnear, tfar)) {
+        return std::vector<float>{};
+    }
+    return std::vector<float>{tnear, tfar};
+}
+
+// Rays from random points on a sphere around the box, aimed at random
+// points inside it, so most of them hit.
+static std::vector<Ray>
+makeRays(const BoundingBox &box, int count)
+{
+    std::mt19937 rng(6837);
+    std::uniform_real_distribution<float> u(0.f, 1.f);
+    Vector3f center = 0.5f * (box.min + box.max);
+    float radius = (box.max - box.min).abs();
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        Vector3f d(u(rng) - 0.5f, u(rng) - 0.5f, u(rng) - 0.5f);
+        Vector3f orig = center + radius * d.normalized();
+        Vector3f target(box.min.x() + u(rng) * box.dx(),
+                        box.min.y() + u(rng) * box.dy(),
+                        box.min.z() + u(rng) * box.dz());
+        rays.push_back(Ray(orig, (target - orig).normalized()));
+    }
+    return rays;
+}
+
+static double
+seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void
+report(const char *name, int rays, long allocations, double time, double check)
+{
+    printf("%-28s %8.3f allocs/ray %8.1f ns/ray   (checksum %g)\n",
+           name, (double)allocations / rays, 1e9 * time / rays, check);
+}
+
+int
+main(int argc, const char *argv[])
+{
+    std::string meshFile = argc > 1 ? argv[1] : "../data/models/bunny_4k.obj";
+    int numRays = argc > 2 ? atoi(argv[2]) : 1000000;
+
+    BoundingBox box(Vector3f(-1, -2, -3), Vector3f(1, 2, 3));
+    std::vector<Ray> rays = makeRays(box, numRays);
+
+    {
+        double sum = 0;
+        long before = g_allocations;
+        auto start = std::chrono::steady_clock::now();
+        for (const Ray &r : rays) {
+            std::vector<float> t = intersectVector(box, r);
+            if (!t.empty()) {
+                sum += t[1] - t[0];
+            }
+        }
+        report("vector<float> intersect", numRays, g_allocations - before,
+               seconds(start), sum);
+    }
+    {
+        double sum = 0;
+        long before = g_allocations;
+        auto start = std::chrono::steady_clock::now();
+        for (const Ray &r : rays) {
+            float tnear, tfar;
+            if (box.intersect(r, tnear, tfar)) {
+                sum += tfar - tnear;
+            }
+        }
+        report("slab test (tnear, tfar)", numRays, g_allocations - before,
+               seconds(start), sum);
+    }
+
+    Material material(Vector3f(1, 1, 1));
+    Mesh mesh(meshFile, &material);
+    if (mesh.numTriangles() == 0) {
+        return 1;
+    }
+    int meshRays = numRays / 10;
+    rays = makeRays(mesh.box, meshRays);
+    {
+        double sum = 0;
+        long before = g_allocations;
+        auto start = std::chrono::steady_clock::now();
+        for (const Ray &r : rays) {
+            Hit h;
+            if (mesh.intersect(r, 0, h)) {
+                sum += h.getT();
+            }
+        }
+        report("Mesh::intersect (KD tree)", meshRays, g_allocations - before,
+               seconds(start), sum);
+    }
+    return 0;
+}
@@ -0,0 +1,152 @@
+// Load-throughput benchmark for OBJ files.
+//
+// Reads a file with the old getline + stringstream loop that Mesh used
+// and with ObjFile, on one thread and on a thread pool, and prints MB/s
+// for each, plus whether ObjFile produced exactly the same vertices and
+// faces as the old loop.
+//
+// Usage: bench_objload file.obj [num_threads] [repeats]
+
+#include "ObjFile.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static double
+seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The loader Mesh::Mesh used before ObjFile, minus the normals.
+static void
+readStream(const std::string &filename, ObjFile &obj)
+{
+    obj.vertices.clear();
+    obj.texCoords.clear();
+    obj.triangles.clear();
+    std::ifstream f(filename.c_str());
+    std::string tok;
+    std::string line;
+    while (true) {
+        std::getline(f, line);
+        if (f.eof()) {
+            break;
+        }
+        if (line.size() < 3 || line.at(0) == '#') {
+            continue;
+        }
+        std::stringstream ss(line);
+        ss >> tok;
+        if (tok == "v") {
+            Vector3f vec;
+            ss >> vec[0] >> vec[1] >> vec[2];
+            obj.vertices.push_back(vec);
+        } else if (tok == "f") {
+            ObjTriangle trig;
+            if (line.find('/') != std::string::npos) {
+                std::replace(line.begin(), line.end(), '/', ' ');
+                std::stringstream facess(line);
+                facess >> tok;
+                for (int ii = 0; ii < 3; ii++) {
+                    facess >> trig[ii] >> trig.texID[ii];
+                    trig[ii]--;
+                    trig.texID[ii]--;
+                }
+            } else {
+                for (int ii = 0; ii < 3; ii++) {
+                    ss >> trig[ii];
+                    trig[ii]--;
+                }
+            }
+            obj.triangles.push_back(trig);
+        } else if (tok == "vt") {
+            Vector2f texcoord;
+            ss >> texcoord[0] >> texcoord[1];
+            obj.texCoords.push_back(texcoord);
+        }
+    }
+}
+
+static bool
+sameGeometry(const ObjFile &a, const ObjFile &b)
+{
+    if (a.vertices.size() != b.vertices.size() || a.triangles.size() != b.triangles.size() ||
+        a.texCoords.size() != b.texCoords.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.vertices.size(); ++i) {
+        if (memcmp(&a.vertices[i], &b.vertices[i], sizeof(Vector3f))) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < a.texCoords.size(); ++i) {
+        if (memcmp(&a.texCoords[i], &b.texCoords[i], sizeof(Vector2f))) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < a.triangles.size(); ++i) {
+        if (a.triangles[i].x != b.triangles[i].x) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, const char *argv[])
+{
+    if (argc < 2) {
+        printf("Usage: bench_objload file.obj [num_threads] [repeats]\n");
+        return 1;
+    }
+    std::string filename = argv[1];
+    int numThreads = argc > 2 ? atoi(argv[2]) : 0;
+    int repeats = argc > 3 ? atoi(argv[3]) : 5;
+
+    std::ifstream f(filename.c_str(), std::ios::binary | std::ios::ate);
+    if (!f) {
+        printf("Cannot open %s\n", filename.c_str());
+        return 1;
+    }
+    double megabytes = f.tellg() / 1e6;
+    ThreadPool pool(numThreads);
+
+    ObjFile reference, single, threaded;
+    // Best of repeats, after the file is in the page cache.
+    double timeStream = 1e30, timeSingle = 1e30, timeThreaded = 1e30;
+    for (int r = 0; r < repeats; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        readStream(filename, reference);
+        timeStream = std::min(timeStream, seconds(start));
+
+        start = std::chrono::steady_clock::now();
+        single.read(filename);
+        timeSingle = std::min(timeSingle, seconds(start));
+
+        start = std::chrono::steady_clock::now();
+        threaded.read(filename, &pool);
+        timeThreaded = std::min(timeThreaded, seconds(start));
+    }
+
+    printf("%s: %.1f MB, %zu vertices, %zu triangles\n", filename.c_str(), megabytes,
+           reference.vertices.size(), reference.triangles.size());
+    printf("getline + stringstream   %8.1f MB/s  (%.1f ms)\n",
+           megabytes / timeStream, timeStream * 1e3);
+    printf("ObjFile, 1 thread        %8.1f MB/s  (%.1f ms)\n",
+           megabytes / timeSingle, timeSingle * 1e3);
+    printf("ObjFile, %2d threads      %8.1f MB/s  (%.1f ms)\n", pool.size(),
+           megabytes / timeThreaded, timeThreaded * 1e3);
+    printf("same geometry as stringstream: %s (1 thread), %s (%d threads)\n",
+           sameGeometry(reference, single) ? "yes" : "NO",
+           sameGeometry(reference, threaded) ? "yes" : "NO", pool.size());
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Microbenchmark for rays through a Transform.
+//
+// Times a transformed sphere three ways: the old path that inverts the
+// matrix for every ray (done here by hand), Transform::intersect with the
+// inverse cached at construction, and the bare sphere with the ray already
+// in object space, so the cost of the transform itself can be read off as
+// the difference. Also checks that the old and new paths agree.
+//
+// Usage: bench_transform [num_rays] [repeats]
+
+#include "Object3D.h"
+#include "Ray.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static double
+seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// What Transform::intersect used to do.
+static bool
+intersectInverse(const Matrix4f &M, const Object3D &object,
+                 const Ray &r, float tmin, Hit &h)
+{
+    Matrix4f worldToLocal = M.inverse();
+    Vector3f rayOriginLocal = (worldToLocal * Vector4f(r.getOrigin(), 1)).xyz();
+    Vector3f rayDirectionLocal = (worldToLocal * Vector4f(r.getDirection(), 0)).xyz();
+    if (object.intersect(Ray(rayOriginLocal, rayDirectionLocal), tmin, h)) {
+        Vector3f normal = (worldToLocal.transposed() * Vector4f(h.getNormal().normalized(), 0)).xyz().normalized();
+        h.set(h.getT(), h.getMaterial(), normal);
+        return true;
+    }
+    return false;
+}
+
+int
+main(int argc, const char *argv[])
+{
+    int numRays = argc > 1 ? atoi(argv[1]) : 100000;
+    int repeats = argc > 2 ? atoi(argv[2]) : 20;
+
+    std::mt19937 rng(6837);
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    Material material(Vector3f(1, 1, 1));
+
+    Sphere sphere(Vector3f(0, 0, 0), 1, &material);
+    Matrix4f M = Matrix4f::translation(0.3f, -0.2f, 0.5f) *
+                 Matrix4f::rotateY(0.7f) * Matrix4f::rotateX(-0.4f) *
+                 Matrix4f::scaling(1.5f, 0.8f, 1.2f);
+    Transform transform(M, &sphere);
+    Matrix4f worldToLocal = M.inverse();
+
+    std::vector<Ray> rays, localRays;
+    for (int i = 0; i < numRays; ++i) {
+        Vector3f orig = 4.f * Vector3f(u(rng), u(rng), u(rng)).normalized();
+        Vector3f target = 1.2f * Vector3f(u(rng), u(rng), u(rng));
+        rays.push_back(Ray(orig, (target - orig).normalized()));
+        localRays.push_back(Ray((worldToLocal * Vector4f(orig, 1)).xyz(),
+                                (worldToLocal * Vector4f(rays.back().getDirection(), 0)).xyz()));
+    }
+    double total = (double)numRays * repeats;
+
+    std::vector<Hit> hitsInverse(numRays), hitsCached(numRays);
+    long count = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < repeats; ++k) {
+        for (int i = 0; i < numRays; ++i) {
+            Hit h;
+            count += intersectInverse(M, sphere, rays[i], 0, h);
+            hitsInverse[i] = h;
+        }
+    }
+    double timeInverse = seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int k = 0; k < repeats; ++k) {
+        for (int i = 0; i < numRays; ++i) {
+            Hit h;
+            count += transform.intersect(rays[i], 0, h);
+            hitsCached[i] = h;
+        }
+    }
+    double timeCached = seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int k = 0; k < repeats; ++k) {
+        for (int i = 0; i < numRays; ++i) {
+            Hit h;
+            count += sphere.intersect(localRays[i], 0, h);
+        }
+    }
+    double timeBare = seconds(start);
+
+    long disagree = 0;
+    float maxError = 0;
+    for (int i = 0; i < numRays; ++i) {
+        const Hit &a = hitsInverse[i], &b = hitsCached[i];
+        if (a.getMaterial() != b.getMaterial()) {
+            disagree++;
+        } else if (a.getMaterial()) {
+            maxError = std::max(maxError, std::fabs(a.getT() - b.getT()));
+            maxError = std::max(maxError, (a.getNormal() - b.getNormal()).abs());
+        }
+    }
+
+    double bare = timeBare / total * 1e9;
+    printf("%-24s %8.1f ns/ray  (%.1f ns over the bare sphere)\n", "inverse per ray",
+           timeInverse / total * 1e9, timeInverse / total * 1e9 - bare);
+    printf("%-24s %8.1f ns/ray  (%.1f ns over the bare sphere)\n", "cached inverse",
+           timeCached / total * 1e9, timeCached / total * 1e9 - bare);
+    printf("%-24s %8.1f ns/ray\n", "bare sphere", bare);
+    printf("speedup %.2fx, hit/miss disagreements %ld of %d, max difference %g (%ld hits)\n",
+           timeInverse / timeCached, disagree, numRays, maxError, count);
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Microbenchmark for ray/triangle intersection.
+//
+// Compares the Moller-Trumbore path (Triangle::intersect) with the old
+// Matrix3f::inverse() path (copied here): tests per second,
+// plus how often the two disagree on hit/miss and the largest relative
+// difference in t when both hit.
+//
+// Usage: bench_triangle [num_triangles] [num_rays]
+
+#include "Object3D.h"
+#include "Ray.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static double
+seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// What Triangle::intersect used to do: solve the 3x3 system with
+// Matrix3f::inverse() for every ray.
+static bool
+intersectInverse(const Triangle &triangle, const Ray &r, float tmin, Hit &h)
+{
+    const Vector3f &v0 = triangle.getVertex(0);
+    Matrix3f A(v0 - triangle.getVertex(1), v0 - triangle.getVertex(2), r.getDirection());
+    Vector3f B = v0 - r.getOrigin();
+    Vector3f X = A.inverse() * B;
+    // Barycentric ratios
+    float alpha = 1 - X[0] - X[1];
+    float beta = X[0];
+    float gamma = X[1];
+    float t = X[2];
+    if (t > h.getT() || t < tmin || alpha < 0 || beta < 0 || gamma < 0) {
+        return false;
+    }
+    h.set(t, triangle.getMaterial(),
+          (alpha * triangle.getNormal(0) + beta * triangle.getNormal(1) +
+           gamma * triangle.getNormal(2)).normalized());
+    return true;
+}
+
+int
+main(int argc, const char *argv[])
+{
+    int numTriangles = argc > 1 ? atoi(argv[1]) : 1000;
+    int numRays = argc > 2 ? atoi(argv[2]) : 2000;
+
+    std::mt19937 rng(6837);
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    Material material(Vector3f(1, 1, 1));
+
+    // Small random triangles in the unit cube, so a decent fraction of
+    // the rays below hit something.
+    std::vector<Triangle> triangles;
+    for (int i = 0; i < numTriangles; ++i) {
+        Vector3f a(u(rng), u(rng), u(rng));
+        Vector3f b = a + 0.3f * Vector3f(u(rng), u(rng), u(rng));
+        Vector3f c = a + 0.3f * Vector3f(u(rng), u(rng), u(rng));
+        Vector3f n = Vector3f::cross(b - a, c - a).normalized();
+        triangles.push_back(Triangle(a, b, c, n, n, n, &material));
+    }
+    std::vector<Ray> rays;
+    for (int i = 0; i < numRays; ++i) {
+        Vector3f orig = 3.f * Vector3f(u(rng), u(rng), u(rng)).normalized();
+        Vector3f target = 0.5f * Vector3f(u(rng), u(rng), u(rng));
+        rays.push_back(Ray(orig, (target - orig).normalized()));
+    }
+    double tests = (double)numTriangles * numRays;
+
+    // Record every result so the two paths can be compared afterwards.
+    std::vector<float> tFast(numRays * (size_t)numTriangles);
+    std::vector<float> tInverse(tFast.size());
+
+    long hitsFast = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < numRays; ++r) {
+        for (int i = 0; i < numTriangles; ++i) {
+            Hit h;
+            bool hit = triangles[i].intersect(rays[r], 0, h);
+            hitsFast += hit;
+            tFast[(size_t)r * numTriangles + i] = hit ? h.getT() : -1.f;
+        }
+    }
+    double timeFast = seconds(start);
+
+    long hitsInverse = 0;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < numRays; ++r) {
+        for (int i = 0; i < numTriangles; ++i) {
+            Hit h;
+            bool hit = intersectInverse(triangles[i], rays[r], 0, h);
+            hitsInverse += hit;
+            tInverse[(size_t)r * numTriangles + i] = hit ? h.getT() : -1.f;
+        }
+    }
+    double timeInverse = seconds(start);
+
+    long disagree = 0;
+    float maxRelError = 0;
+    for (size_t i = 0; i < tFast.size(); ++i) {
+        if ((tFast[i] < 0) != (tInverse[i] < 0)) {
+            disagree++;
+        } else if (tFast[i] >= 0) {
+            float err = std::fabs(tFast[i] - tInverse[i]) / std::max(tInverse[i], 1e-6f);
+            maxRelError = std::max(maxRelError, err);
+        }
+    }
+
+    printf("%-24s %10.2f Mtests/s  %ld hits\n", "Matrix3f::inverse()",
+           tests / timeInverse * 1e-6, hitsInverse);
+    printf("%-24s %10.2f Mtests/s  %ld hits\n", "Moller-Trumbore",
+           tests / timeFast * 1e-6, hitsFast);
+    printf("speedup %.2fx, hit/miss disagreements %ld of %.0f, max relative t error %g\n",
+           timeInverse / timeFast, disagree, tests, maxRelError);
+    return 0;
+}
@@ -0,0 +1,88 @@
+// Writes a scene with N random spheres over a ground plane, for measuring
+// how render time scales with the number of objects in a Group.
+//
+// Usage: gen_spheres <num_spheres> [seed] > scene.txt
+// then e.g. ./a4 -input scene.txt -size 400 400 -shadows
+//
+// Spheres are scattered through a cube whose volume grows with N, with
+// radii chosen so that the cube stays about equally full, and the camera
+// backs off to keep the whole cube in view.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+int
+main(int argc, const char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <num_spheres> [seed]\n", argv[0]);
+        return 1;
+    }
+    int n = atoi(argv[1]);
+    unsigned seed = argc > 2 ? (unsigned)atoi(argv[2]) : 6837;
+    const int numMaterials = 4;
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> u(0.f, 1.f);
+    float side = std::cbrt((float)std::max(n, 1));
+    float radius = 0.3f;
+
+    printf("PerspectiveCamera {\n"
+           "    center %g %g %g\n"
+           "    direction 0 -0.4 -1\n"
+           "    up 0 1 0\n"
+           "    angle 45\n"
+           "}\n\n", 0.f, 0.6f * side + 1, 1.6f * side + 2);
+    printf("Lights {\n"
+           "    numLights 2\n"
+           "    DirectionalLight {\n"
+           "        direction 0.3 -1 -0.5\n"
+           "        color 0.7 0.7 0.7\n"
+           "    }\n"
+           "    PointLight {\n"
+           "        position 0 %g %g\n"
+           "        color 0.5 0.5 0.5\n"
+           "        falloff 0.01\n"
+           "    }\n"
+           "}\n\n", 2 * side, side);
+    printf("Background {\n"
+           "    color 0.2 0.2 0.3\n"
+           "    ambientLight 0.1 0.1 0.1\n"
+           "}\n\n");
+
+    printf("Materials {\n"
+           "    numMaterials %d\n", numMaterials + 1);
+    for (int i = 0; i < numMaterials; ++i) {
+        printf("    PhongMaterial {\n"
+               "        diffuseColor %g %g %g\n"
+               "        specularColor 0.3 0.3 0.3\n"
+               "        shininess 20\n"
+               "    }\n", 0.2f + 0.8f * u(rng), 0.2f + 0.8f * u(rng), 0.2f + 0.8f * u(rng));
+    }
+    printf("    PhongMaterial {\n"
+           "        diffuseColor 0.5 0.5 0.5\n"
+           "    }\n"
+           "}\n\n");
+
+    printf("Group {\n"
+           "    numObjects %d\n", n + 1);
+    printf("    MaterialIndex %d\n"
+           "    Plane {\n"
+           "        normal 0 1 0\n"
+           "        offset %g\n"
+           "    }\n", numMaterials, -0.5f * side - radius);
+    for (int i = 0; i < n; ++i) {
+        printf("    MaterialIndex %d\n"
+               "    Sphere {\n"
+               "        center %g %g %g\n"
+               "        radius %g\n"
+               "    }\n",
+               (int)(u(rng) * numMaterials) % numMaterials,
+               side * (u(rng) - 0.5f), side * (u(rng) - 0.5f), side * (u(rng) - 0.5f),
+               radius * (0.5f + u(rng)));
+    }
+    printf("}\n");
+    return 0;
+}
@@ -21,6 +21,14 @@ ArgParser::ArgParser(int argc, const char *argv[])
         } else if (!strcmp(argv[i], "-normals")) {
             i++; assert (i < argc); 
             normals_file = argv[i];
+        } else if (!strcmp(argv[i], "-pixel-format")) {
+            i++; assert (i < argc); 
+            pixel_format = argv[i];
+            if (pixel_format != "float" && pixel_format != "rgb8" &&
+                pixel_format != "half" && pixel_format != "rgbe") {
+                printf ("Unknown pixel format '%s' (expected float, rgb8, half or rgbe)\n", argv[i]);
+                exit(1);
+            }
         } else if (!strcmp(argv[i], "-size")) {
             i++; assert (i < argc); 
             width = atoi(argv[i]);
@@ -28,6 +36,15 @@ ArgParser::ArgParser(int argc, const char *argv[])
             height = atoi(argv[i]);
         } 
 
+        // statistics
+        else if (!strcmp(argv[i], "-stats")) {
+            stats = 1;
+        } else if (!strcmp(argv[i], "-stats-json")) {
+            i++; assert (i < argc); 
+            stats = 1;
+            stats_file = argv[i];
+        }
+
         // rendering options
         else if (!strcmp(argv[i], "-depth")) {
             i++; assert (i < argc); 
@@ -41,6 +58,12 @@ ArgParser::ArgParser(int argc, const char *argv[])
             bounces = atoi(argv[i]);
         } else if (!strcmp(argv[i], "-shadows")) {
             shadows = true;
+        } else if (!strcmp(argv[i], "-min-throughput")) {
+            i++; assert (i < argc); 
+            min_throughput = (float)atof(argv[i]);
+        } else if (!strcmp(argv[i], "-roulette")) {
+            i++; assert (i < argc); 
+            roulette = (float)atof(argv[i]);
         }
 
         // supersampling
@@ -48,24 +71,106 @@ ArgParser::ArgParser(int argc, const char *argv[])
             jitter = true;
         } else if(strcmp(argv[i], "-filter") == 0) {
             filter = true;
+            // optional kernel name
+            if (i + 1 < argc && (!strcmp(argv[i + 1], "gaussian") ||
+                                 !strcmp(argv[i + 1], "tent") ||
+                                 !strcmp(argv[i + 1], "box"))) {
+                i++;
+                filter_kernel = argv[i];
+            }
+        } else if (!strcmp(argv[i], "-samples")) {
+            i++; assert (i < argc); 
+            samples = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-adaptive")) {
+            i++; assert (i < argc); 
+            adaptive_threshold = (float)atof(argv[i]);
+            i++; assert (i < argc); 
+            adaptive_samples = atoi(argv[i]);
         } 
+
+        // progressive rendering
+        else if (!strcmp(argv[i], "-time-budget")) {
+            i++; assert (i < argc); 
+            time_budget = (float)atof(argv[i]);
+        }
+
+        // parallelism
+        else if (!strcmp(argv[i], "-threads")) {
+            i++; assert (i < argc); 
+            threads = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-packets")) {
+            i++; assert (i < argc); 
+            packets = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-wavefront")) {
+            wavefront = true;
+        } else if (!strcmp(argv[i], "-sort-rays")) {
+            // Sorting needs the reflection rays of a whole pass at once.
+            wavefront = true;
+            sort_rays = true;
+        }
+
+        // acceleration structure
+        else if (!strcmp(argv[i], "-accel")) {
+            i++; assert (i < argc); 
+            accel = argv[i];
+            if (accel != "brute" && accel != "octree" &&
+                accel != "kdtree" && accel != "bvh") {
+                printf ("Unknown acceleration structure '%s' (expected bvh, kdtree, octree or brute)\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "-cache")) {
+            i++; assert (i < argc); 
+            cache_dir = argv[i];
+        }
         else {
             printf ("Unknown command line argument %d: '%s'\n", i, argv[i]);
             exit(1);
         }
     }
 
+    // -jitter on its own means 3x3 jittered samples, as in the assignment.
+    if (samples <= 0) {
+        samples = jitter ? 9 : 1;
+    }
+
+    // Sampled and progressive renders go through tiles of samples, which
+    // would silently ignore these.
+    if (wavefront && (samples > 1 || jitter || filter || adaptive_threshold > 0 ||
+                      time_budget > 0)) {
+        printf ("%s only works for one-sample renders, not with -jitter, -samples, -filter, -adaptive or -time-budget\n",
+                sort_rays ? "-sort-rays" : "-wavefront");
+        exit(1);
+    }
+
     std::cout << "Args:\n";
     std::cout << "- input: " << input_file << std::endl;
     std::cout << "- output: " << output_file << std::endl;
     std::cout << "- depth_file: " << depth_file << std::endl;
     std::cout << "- normals_file: " << normals_file << std::endl;
+    std::cout << "- pixel format: " << pixel_format << std::endl;
     std::cout << "- width: " << width << std::endl;
     std::cout << "- height: " << height << std::endl;
     std::cout << "- depth_min: " << depth_min << std::endl;
     std::cout << "- depth_max: " << depth_max << std::endl;
     std::cout << "- bounces: " << bounces << std::endl;
     std::cout << "- shadows: " << shadows << std::endl;
+    std::cout << "- min throughput: " << min_throughput << std::endl;
+    if (roulette > 0) {
+        std::cout << "- roulette below: " << roulette << std::endl;
+    }
+    std::cout << "- samples: " << samples << (jitter ? " jittered" : "") << std::endl;
+    std::cout << "- filter: " << (filter ? filter_kernel : "box") << std::endl;
+    if (adaptive_threshold > 0) {
+        std::cout << "- adaptive: " << adaptive_samples << " more samples above variance "
+                  << adaptive_threshold << std::endl;
+    }
+    if (time_budget > 0) {
+        std::cout << "- time budget: " << time_budget << "s" << std::endl;
+    }
+    std::cout << "- threads: " << threads << std::endl;
+    std::cout << "- packets: " << packets << std::endl;
+    std::cout << "- wavefront: " << wavefront << (sort_rays ? ", sorted secondary rays" : "") << std::endl;
+    std::cout << "- accel: " << accel << std::endl;
 }
 
 void
@@ -76,17 +181,38 @@ ArgParser::defaultValues()
     output_file = "";
     depth_file = "";
     normals_file = "";
+    pixel_format = "float";
     width = 100;
     height = 100;
     stats = 0;
+    stats_file = "";
 
     // rendering options
     depth_min = 0;
     depth_max = 1;
     bounces = 0;
     shadows = false;
+    min_throughput = 1e-3f;
+    roulette = 0;
 
     // sampling
     jitter = false;
     filter = false;
+    samples = 0;
+    filter_kernel = "gaussian";
+    adaptive_threshold = 0;
+    adaptive_samples = 16;
+
+    // progressive rendering
+    time_budget = 0;
+
+    // parallelism
+    threads = 0;
+    packets = 0;
+    wavefront = false;
+    sort_rays = false;
+
+    // acceleration structure
+    accel = "kdtree";
+    cache_dir = "";
 }
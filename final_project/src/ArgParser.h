@@ -16,19 +16,56 @@ public:
     std::string output_file;
     std::string depth_file;
     std::string normals_file;
+    // how the output images keep their pixels while rendering: float,
+    // rgb8, half or rgbe
+    std::string pixel_format;
     int width;
     int height;
     int stats;
+    // with -stats-json, where to write the stats as JSON
+    std::string stats_file;
 
     // rendering options
     float depth_min;
     float depth_max;
     int bounces;
     bool shadows;
+    // reflection paths stop once no channel of their weight is above
+    // min_throughput; with roulette > 0, paths below that weight go on
+    // with probability weight / roulette
+    float min_throughput;
+    float roulette;
 
     // supersampling
     bool jitter;
     bool filter;
+    // samples per pixel, rounded to a square number of strata
+    int samples;
+    // reconstruction filter with -filter: gaussian, tent or box
+    std::string filter_kernel;
+    // pixels whose neighbourhood variance is above adaptive_threshold get
+    // adaptive_samples more samples (threshold 0 = off)
+    float adaptive_threshold;
+    int adaptive_samples;
+
+    // progressive rendering: stop refining after this many seconds,
+    // counted from when the scene starts loading (0 = off)
+    float time_budget;
+
+    // parallelism (0 = one thread per hardware core)
+    int threads;
+    // primary ray packet width: 0 = off, 4 = SSE, 8 = AVX2
+    int packets;
+    // trace one-sample renders breadth first, a pass per bounce
+    bool wavefront;
+    // with -wavefront, sort each pass's reflection rays by octant and
+    // origin before tracing them (-sort-rays turns on -wavefront)
+    bool sort_rays;
+
+    // mesh acceleration structure: bvh, kdtree, octree or brute
+    std::string accel;
+    // with -cache, directory for cached meshes and their structures
+    std::string cache_dir;
 
 private:
     void defaultValues();
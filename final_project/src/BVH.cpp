@@ -0,0 +1,197 @@
+#include "BVH.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+
+float BVH::traversalCost = 1;
+float BVH::intersectionCost = 8;
+int BVH::numBins = 12;
+int BVH::maxLeafSize = 4;
+
+// Subtrees with fewer primitives than this are never handed to the pool.
+static const int MIN_PARALLEL_PRIMITIVES = 1024;
+
+// An axis-aligned box as plain floats, for the build.
+struct BuildBox
+{
+    float lo[3], hi[3];
+
+    BuildBox()
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            lo[a] = INFINITY;
+            hi[a] = -INFINITY;
+        }
+    }
+
+    void grow(const float *plo, const float *phi)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            lo[a] = std::min(lo[a], plo[a]);
+            hi[a] = std::max(hi[a], phi[a]);
+        }
+    }
+
+    float d(int axis) const
+    {
+        return hi[axis] - lo[axis];
+    }
+
+    // Same arithmetic as BoundingBox::surfaceArea.
+    float surfaceArea() const
+    {
+        float x = d(0), y = d(1), z = d(2);
+        return 2 * (x * y + y * z + z * x);
+    }
+};
+
+void BVH::build(const std::vector<BoundingBox> &boxes, ThreadPool *pool)
+{
+    nodes.clear();
+    indices.clear();
+    if (boxes.empty())
+        return;
+
+    std::vector<BuildEntry> entries(boxes.size());
+    for (uint32_t i = 0; i < boxes.size(); i++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            entries[i].lo[a] = boxes[i].min[a];
+            entries[i].hi[a] = boxes[i].max[a];
+            entries[i].centroid[a] = 0.5f * (entries[i].lo[a] + entries[i].hi[a]);
+        }
+        entries[i].index = i;
+    }
+    nodes.reserve(2 * boxes.size());
+    indices.reserve(boxes.size());
+    buildNode(entries, 0, (int)entries.size(), 0, pool, pool ? pool->taskDepth(2) : 0);
+}
+
+void BVH::append(const BVH &subtree)
+{
+    uint32_t nodeBase = (uint32_t)nodes.size();
+    uint32_t indexBase = (uint32_t)indices.size();
+    for (BVHNode node : subtree.nodes)
+    {
+        node.offset += node.count ? indexBase : nodeBase;
+        nodes.push_back(node);
+    }
+    indices.insert(indices.end(), subtree.indices.begin(), subtree.indices.end());
+}
+
+void BVH::buildNode(std::vector<BuildEntry> &entries, int begin, int end, int depth,
+                    ThreadPool *pool, int taskDepth)
+{
+    uint32_t self = (uint32_t)nodes.size();
+    nodes.push_back(BVHNode());
+
+    BuildBox box, centroids;
+    for (int i = begin; i < end; i++)
+    {
+        box.grow(entries[i].lo, entries[i].hi);
+        centroids.grow(entries[i].centroid, entries[i].centroid);
+    }
+    nodes[self].box = BoundingBox(Vector3f(box.lo[0], box.lo[1], box.lo[2]),
+                                  Vector3f(box.hi[0], box.hi[1], box.hi[2]));
+
+    int n = end - begin;
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (centroids.d(a) > centroids.d(axis))
+            axis = a;
+    float lo = centroids.lo[axis], extent = centroids.d(axis);
+
+    // Bucket the centroids and sweep the bucket boundaries from both
+    // sides to get the SAH cost of every split.
+    int bestSplit = -1;
+    float bestCost = INFINITY;
+    if (n > 1 && extent > 0 && depth < MAX_DEPTH - 1)
+    {
+        std::vector<int> counts(numBins, 0);
+        std::vector<BuildBox> bins(numBins);
+        for (int i = begin; i < end; i++)
+        {
+            int b = std::min(numBins - 1,
+                             (int)(numBins * (entries[i].centroid[axis] - lo) / extent));
+            counts[b]++;
+            bins[b].grow(entries[i].lo, entries[i].hi);
+        }
+        std::vector<float> rightArea(numBins, 0);
+        std::vector<int> rightCount(numBins, 0);
+        BuildBox acc;
+        int count = 0;
+        for (int b = numBins - 1; b > 0; b--)
+        {
+            acc.grow(bins[b].lo, bins[b].hi);
+            count += counts[b];
+            rightArea[b] = count ? acc.surfaceArea() : 0;
+            rightCount[b] = count;
+        }
+        acc = BuildBox();
+        count = 0;
+        float area = box.surfaceArea();
+        for (int b = 0; b < numBins - 1; b++)
+        {
+            acc.grow(bins[b].lo, bins[b].hi);
+            count += counts[b];
+            if (count == 0 || rightCount[b + 1] == 0)
+                continue;
+            float cost = traversalCost + intersectionCost *
+                (count * acc.surfaceArea() + rightCount[b + 1] * rightArea[b + 1]) / area;
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+    }
+
+    bool split = bestSplit >= 0 &&
+                 (n > maxLeafSize || bestCost < intersectionCost * n);
+    if (!split)
+    {
+        nodes[self].offset = (uint32_t)indices.size();
+        nodes[self].count = (uint32_t)n;
+        nodes[self].axis = 0;
+        for (int i = begin; i < end; i++)
+            indices.push_back(entries[i].index);
+        return;
+    }
+
+    BuildEntry *mid = std::partition(
+        &entries[begin], &entries[0] + end, [&](const BuildEntry &e) {
+            int b = std::min(numBins - 1, (int)(numBins * (e.centroid[axis] - lo) / extent));
+            return b <= bestSplit;
+        });
+    int middle = (int)(mid - &entries[0]);
+
+    uint32_t second;
+    if (depth < taskDepth && n >= MIN_PARALLEL_PRIMITIVES)
+    {
+        // The two halves of entries are disjoint, so both subtrees can be
+        // built at once into trees of their own, then appended in the
+        // order the serial build would have produced.
+        BVH children[2];
+        pool->parallelFor(2, [&](int child) {
+            if (child == 0)
+                children[0].buildNode(entries, begin, middle, depth + 1, pool, taskDepth);
+            else
+                children[1].buildNode(entries, middle, end, depth + 1, pool, taskDepth);
+        });
+        append(children[0]);
+        second = (uint32_t)nodes.size();
+        append(children[1]);
+    }
+    else
+    {
+        buildNode(entries, begin, middle, depth + 1, pool, taskDepth);
+        second = (uint32_t)nodes.size();
+        buildNode(entries, middle, end, depth + 1, pool, taskDepth);
+    }
+    nodes[self].offset = second;
+    nodes[self].count = 0;
+    nodes[self].axis = (uint32_t)axis;
+}
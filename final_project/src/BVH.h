@@ -0,0 +1,233 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <stdint.h>
+#include "Object3D.h"
+
+class ThreadPool;
+
+// FINAL PROJECT
+// Node of a BVH, 32 bytes. Interior nodes keep their first child right
+// after themselves in BVH::nodes and store the index of the second one;
+// leaves store where their primitives start in BVH::indices.
+struct BVHNode {
+    BoundingBox box;
+    uint32_t offset;   // leaf: first entry in BVH::indices; interior: second child
+    // Number of primitives, 0 for interior nodes. Leaves that cannot be
+    // split (coincident centroids, MAX_DEPTH) can be very large.
+    uint32_t count : 30;
+    uint32_t axis : 2; // split axis of an interior node
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode should fill half a cache line");
+
+// FINAL PROJECT
+// Bounding volume hierarchy built with the binned surface area heuristic
+// (Wald 2007): at each node the primitives' centroids are dropped into
+// numBins buckets along the widest axis and only the bucket boundaries are
+// tried as splits. Works on any list of bounding boxes; intersect calls
+// back into the caller for the primitives in the leaves a ray reaches.
+class BVH {
+public:
+    // Same cost model as KDTree: traversalCost for visiting a node,
+    // intersectionCost for each primitive test.
+    static float traversalCost;
+    static float intersectionCost;
+    static int numBins;
+    // Nodes with more primitives than this are always split.
+    static int maxLeafSize;
+    // Deepest tree the traversal stack can handle; deeper nodes become
+    // leaves.
+    static const int MAX_DEPTH = 64;
+
+    // With a pool, the subtrees near the root are built as parallel tasks
+    // and spliced together; the result is the same as without.
+    void build(const std::vector<BoundingBox> &boxes, ThreadPool *pool = NULL);
+
+    bool empty() const { return nodes.empty(); }
+
+    // Visits the nodes the ray passes through, nearest child first, and
+    // calls intersectPrimitive(index) for every primitive in the leaves it
+    // reaches; intersectPrimitive updates h and returns whether it hit.
+    // Nodes starting beyond h.getT() are skipped.
+    template <class F>
+    bool intersect(const Ray &r, float tmin, Hit &h, F intersectPrimitive) const;
+
+    // Any-hit version: true as soon as anyPrimitive(index) returns true
+    // for a primitive in a leaf whose box overlaps [tmin, tmax].
+    template <class F>
+    bool occluded(const Ray &r, float tmin, float tmax, F anyPrimitive) const;
+
+    // Packet version: visits every node that at least one ray of the
+    // packet would visit, in the order of the first ray, and calls
+    // intersectPrimitive(index), which returns a lane hit mask.
+    template <class F>
+    int intersectPacket(const RayPacket &packet, float tmin, Hit *hits,
+                        F intersectPrimitive) const;
+
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> indices;
+
+private:
+    // Plain floats rather than BoundingBox: the build reads these for every
+    // primitive at every level, and Vector3f's accessors are not inline.
+    struct BuildEntry {
+        float lo[3], hi[3];
+        float centroid[3];
+        uint32_t index;
+    };
+
+    // Appends the subtree over entries [begin, end) to nodes and indices.
+    void buildNode(std::vector<BuildEntry> &entries, int begin, int end, int depth,
+                   ThreadPool *pool, int taskDepth);
+
+    // Appends another tree's arrays, moving its offsets past what is
+    // already here.
+    void append(const BVH &subtree);
+};
+
+template <class F>
+bool BVH::intersect(const Ray &r, float tmin, Hit &h, F intersectPrimitive) const
+{
+    if (nodes.empty())
+        return false;
+
+    uint32_t stack[MAX_DEPTH];
+    int top = 0;
+    Stats::Visits visits;
+    bool result = false;
+    uint32_t current = 0;
+    while (true)
+    {
+        const BVHNode &node = nodes[current];
+        float tnear, tfar;
+        if (node.box.intersect(r, tnear, tfar) &&
+            tnear <= h.getT() && tfar >= tmin)
+        {
+            if (node.count > 0)
+            {
+                visits.leaves++;
+                const uint32_t *index = &indices[node.offset];
+                for (int i = 0; i < node.count; i++)
+                    result |= intersectPrimitive(index[i]);
+            }
+            else
+            {
+                visits.nodes++;
+                // Visit the child on the side the ray comes from first.
+                if (r.sign[node.axis])
+                {
+                    stack[top++] = current + 1;
+                    current = node.offset;
+                }
+                else
+                {
+                    stack[top++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (top == 0)
+            break;
+        current = stack[--top];
+    }
+    return result;
+}
+
+template <class F>
+bool BVH::occluded(const Ray &r, float tmin, float tmax, F anyPrimitive) const
+{
+    if (nodes.empty())
+        return false;
+
+    uint32_t stack[MAX_DEPTH];
+    int top = 0;
+    Stats::Visits visits;
+    uint32_t current = 0;
+    while (true)
+    {
+        const BVHNode &node = nodes[current];
+        float tnear, tfar;
+        if (node.box.intersect(r, tnear, tfar) && tnear <= tmax && tfar >= tmin)
+        {
+            if (node.count > 0)
+            {
+                visits.leaves++;
+                const uint32_t *index = &indices[node.offset];
+                for (int i = 0; i < node.count; i++)
+                    if (anyPrimitive(index[i]))
+                        return true;
+            }
+            else
+            {
+                visits.nodes++;
+                stack[top++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (top == 0)
+            break;
+        current = stack[--top];
+    }
+    return false;
+}
+
+template <class F>
+int BVH::intersectPacket(const RayPacket &packet, float tmin, Hit *hits,
+                         F intersectPrimitive) const
+{
+    if (nodes.empty())
+        return 0;
+
+    const Ray &first = packet.rays[0];
+    uint32_t stack[MAX_DEPTH];
+    int top = 0;
+    Stats::Visits visits;
+    int mask = 0;
+    uint32_t current = 0;
+    while (true)
+    {
+        const BVHNode &node = nodes[current];
+        bool visit = false;
+        for (int i = 0; i < packet.size && !visit; i++)
+        {
+            float tnear, tfar;
+            visit = node.box.intersect(packet.rays[i], tnear, tfar) &&
+                    tnear <= hits[i].getT() && tfar >= tmin;
+        }
+        if (visit)
+        {
+            if (node.count > 0)
+            {
+                visits.leaves++;
+                const uint32_t *index = &indices[node.offset];
+                for (int i = 0; i < node.count; i++)
+                    mask |= intersectPrimitive(index[i]);
+            }
+            else
+            {
+                visits.nodes++;
+                if (first.sign[node.axis])
+                {
+                    stack[top++] = current + 1;
+                    current = node.offset;
+                }
+                else
+                {
+                    stack[top++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (top == 0)
+            break;
+        current = stack[--top];
+    }
+    return mask;
+}
+
+#endif // BVH_H
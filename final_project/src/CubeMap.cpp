@@ -25,10 +25,10 @@ CubeMap::getFaceTexel(float x, float y, int face) const
     float alpha = x - ix;
     float beta = y - iy;
 
-    const Vector3f &pixel0 = getTexturePixel(ix + 0, iy + 0, face);
-    const Vector3f &pixel1 = getTexturePixel(ix + 1, iy + 0, face);
-    const Vector3f &pixel2 = getTexturePixel(ix + 0, iy + 1, face);
-    const Vector3f &pixel3 = getTexturePixel(ix + 1, iy + 1, face);
+    Vector3f pixel0 = getTexturePixel(ix + 0, iy + 0, face);
+    Vector3f pixel1 = getTexturePixel(ix + 1, iy + 0, face);
+    Vector3f pixel2 = getTexturePixel(ix + 0, iy + 1, face);
+    Vector3f pixel3 = getTexturePixel(ix + 1, iy + 1, face);
 
     Vector3f color;
     for (int ii = 0; ii < 3; ii++) {
@@ -47,7 +47,7 @@ private:
         }
     }
 
-    const Vector3f & getTexturePixel(int x, int y, int face) const {
+    Vector3f getTexturePixel(int x, int y, int face) const {
         x = clamp(x, 0, _images[face].getWidth() - 1);
         y = clamp(y, 0, _images[face].getHeight() - 1);
         return _images[face].getPixel(x, y);
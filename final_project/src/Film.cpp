@@ -0,0 +1,123 @@
+#include "Film.h"
+
+#include "Image.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Standard deviation of the Gaussian, in pixels. Both the tent and the
+// Gaussian reach zero 1.5 pixels out, so they also blend in a ring of
+// neighbouring pixels, as the 6.837 downsampling kernel did.
+static const float GAUSSIAN_SIGMA = 0.5f;
+static const float FILTER_RADIUS = 1.5f;
+
+bool
+Filter::parse(const std::string &name, Kind &kind) {
+    if (name == "box") {
+        kind = BOX;
+    } else if (name == "tent") {
+        kind = TENT;
+    } else if (name == "gaussian") {
+        kind = GAUSSIAN;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+Filter::Filter(Kind kind) :
+    _kind(kind),
+    _radius(kind == BOX ? 0 : FILTER_RADIUS) {
+}
+
+float
+Filter::weight(float d) const {
+    d = std::fabs(d);
+    switch (_kind) {
+    case BOX:
+        return d <= 0.5f ? 1.0f : 0.0f;
+    case TENT:
+        return std::max(0.0f, 1.0f - d / _radius);
+    case GAUSSIAN: {
+        // Shifted down so that the weight goes to zero at the radius
+        // instead of stopping at a step.
+        float s = 2 * GAUSSIAN_SIGMA * GAUSSIAN_SIGMA;
+        return std::max(0.0f, std::exp(-d * d / s) - std::exp(-_radius * _radius / s));
+    }
+    }
+    return 0;
+}
+
+Film::Film(int width, int height, const Filter &filter,
+           bool normals, bool depth) :
+    _width(width),
+    _height(height),
+    _filter(filter),
+    _color(width * height),
+    _normal(normals ? width * height : 0),
+    _depth(depth ? width * height : 0),
+    _weight(width * height, 0.0f) {
+}
+
+void
+Film::addSample(float x, float y, const Vector3f &color,
+                const Vector3f &normal, const Vector3f &depth) {
+    int x0, x1, y0, y1;
+    if (_filter.getKind() == Filter::BOX) {
+        // Only the pixel the sample is in; samples on the image border
+        // belong to the border pixels.
+        x0 = x1 = std::min(std::max((int)std::floor(x + 0.5f), 0), _width - 1);
+        y0 = y1 = std::min(std::max((int)std::floor(y + 0.5f), 0), _height - 1);
+    } else {
+        float r = _filter.getRadius();
+        x0 = std::max((int)std::ceil(x - r), 0);
+        x1 = std::min((int)std::floor(x + r), _width - 1);
+        y0 = std::max((int)std::ceil(y - r), 0);
+        y1 = std::min((int)std::floor(y + r), _height - 1);
+    }
+    for (int py = y0; py <= y1; ++py) {
+        float wy = _filter.getKind() == Filter::BOX ? 1.0f : _filter.weight(py - y);
+        if (wy == 0) {
+            continue;
+        }
+        for (int px = x0; px <= x1; ++px) {
+            float w = _filter.getKind() == Filter::BOX ? 1.0f : wy * _filter.weight(px - x);
+            if (w == 0) {
+                continue;
+            }
+            int i = py * _width + px;
+            _color[i] += w * color;
+            if (!_normal.empty()) {
+                _normal[i] += w * normal;
+            }
+            if (!_depth.empty()) {
+                _depth[i] += w * depth;
+            }
+            _weight[i] += w;
+        }
+    }
+}
+
+Vector3f
+Film::getColor(int x, int y) const {
+    int i = y * _width + x;
+    return _weight[i] > 0 ? _color[i] / _weight[i] : Vector3f(0);
+}
+
+void
+Film::resolve(Image &image, Image &nimage, Image &dimage) const {
+    for (int y = 0; y < _height; ++y) {
+        for (int x = 0; x < _width; ++x) {
+            int i = y * _width + x;
+            if (_weight[i] > 0) {
+                image.setPixel(x, y, _color[i] / _weight[i]);
+                if (!_normal.empty()) {
+                    nimage.setPixel(x, y, _normal[i] / _weight[i]);
+                }
+                if (!_depth.empty()) {
+                    dimage.setPixel(x, y, _depth[i] / _weight[i]);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef FILM_H
+#define FILM_H
+
+#include <string>
+#include <vector>
+
+#include "vecmath.h"
+
+class Image;
+
+// FINAL PROJECT
+// Reconstruction filter for supersampling. Filters are separable: a sample
+// at offset (dx, dy) from a pixel center counts with weight(dx) * weight(dy).
+class Filter
+{
+public:
+    enum Kind { BOX, TENT, GAUSSIAN };
+
+    // Sets kind from "box", "tent" or "gaussian"; false for other names.
+    static bool parse(const std::string &name, Kind &kind);
+
+    explicit Filter(Kind kind = BOX);
+
+    Kind getKind() const {
+        return _kind;
+    }
+
+    // How far from a pixel center, in pixels along each axis, samples
+    // still count. Box filters only count samples inside the pixel.
+    float getRadius() const {
+        return _radius;
+    }
+
+    float weight(float d) const;
+
+private:
+    Kind _kind;
+    float _radius;
+};
+
+// FINAL PROJECT
+// Accumulates filtered samples for the color, normal and depth images.
+// Samples are given in continuous pixel coordinates, with pixel (x, y)
+// centered on (x, y) and covering [x - 0.5, x + 0.5] x [y - 0.5, y + 0.5].
+//
+// addSample writes to every pixel within the filter radius, so callers
+// that add samples from several threads must keep them far enough apart.
+//
+// The normal and depth buffers are only allocated if asked for; without
+// them addSample ignores the sample's normal or depth.
+class Film
+{
+public:
+    Film(int width, int height, const Filter &filter,
+         bool normals = true, bool depth = true);
+
+    void addSample(float x, float y, const Vector3f &color,
+                   const Vector3f &normal, const Vector3f &depth);
+
+    // Filtered color of the samples so far.
+    Vector3f getColor(int x, int y) const;
+
+    // Writes the filtered color, normal and depth of every pixel.
+    void resolve(Image &image, Image &nimage, Image &dimage) const;
+
+private:
+    int _width;
+    int _height;
+    Filter _filter;
+    std::vector<Vector3f> _color;
+    std::vector<Vector3f> _normal;
+    std::vector<Vector3f> _depth;
+    std::vector<float> _weight;
+};
+
+#endif // FILM_H
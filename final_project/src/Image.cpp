@@ -1,49 +1,206 @@
+#include <algorithm>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 #include <cassert>
+#include <cmath>
 
 #include "Image.h"
+#include "ImageWriter.h"
 
 #include "stb_image.h"
-#include "stb_image_write.h"
 
-static
-uint8_t
+static uint8_t
 clampColorComponent(float c)
 {
     int tmp = int(c * 255);
-
     if (tmp < 0) {
         tmp = 0;
     }
-
     if (tmp > 255) {
         tmp = 255;
     }
-
     return uint8_t(tmp);
 }
 
+// IEEE half precision, rounded to nearest even; too large values become
+// infinity.
+static uint16_t
+floatToHalf(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+    uint32_t a = x & 0x7fffffff;
+    if (a > 0x7f800000) {
+        return sign | 0x7e00;                   // NaN
+    }
+    if (a >= 0x477ff000) {
+        return sign | 0x7c00;                   // 65520 and up round to infinity
+    }
+    if (a < 0x38800000) {
+        // Below 2^-14 halves are denormal, multiples of 2^-24.
+        float v;
+        memcpy(&v, &a, sizeof(v));
+        return sign | (uint16_t)lrintf(v * 16777216.0f);
+    }
+    uint32_t h = (a - 0x38000000) >> 13;        // exponent bias 127 -> 15
+    uint32_t rest = a & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+        ++h;
+    }
+    return sign | (uint16_t)h;
+}
+
+static float
+halfToFloat(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t x;
+    if (exponent == 0) {
+        float v = mantissa / 16777216.0f;
+        memcpy(&x, &v, sizeof(x));
+        x |= sign;
+    } else if (exponent == 31) {
+        x = sign | 0x7f800000 | mantissa << 13;
+    } else {
+        x = sign | (exponent + 112) << 23 | mantissa << 13;
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+int
+Image::pixelSize(PixelFormat format)
+{
+    switch (format) {
+    case RGB8:
+        return 3;
+    case RGB16F:
+        return 6;
+    case RGBE:
+        return 4;
+    default:
+        return 12;
+    }
+}
+
 void
-Image::savePNG(const std::string &filename) const
+Image::pack(const Vector3f &color, uint8_t *pixel) const
 {
-    assert(!filename.empty());
+    if (_format == RGB8) {
+        for (int c = 0; c < 3; ++c) {
+            pixel[c] = clampColorComponent(color[c]);
+        }
+    } else if (_format == RGB16F) {
+        uint16_t h[3] = { floatToHalf(color[0]), floatToHalf(color[1]), floatToHalf(color[2]) };
+        memcpy(pixel, h, sizeof(h));
+    } else {
+        // Ward's RGBE: the largest component sets the exponent, the
+        // mantissas keep 8 bits relative to it. Negative colors are black.
+        float largest = std::max(color[0], std::max(color[1], color[2]));
+        int exponent;
+        if (!(largest > 1e-32f)) {
+            memset(pixel, 0, 4);
+            return;
+        }
+        float scale = frexpf(largest, &exponent) * 256.0f / largest;
+        for (int c = 0; c < 3; ++c) {
+            pixel[c] = (uint8_t)std::min(std::max(color[c], 0.0f) * scale, 255.0f);
+        }
+        pixel[3] = (uint8_t)std::min(exponent + 128, 255);
+    }
+}
 
-    std::vector<uint8_t> buffer;
-    buffer.resize(_width * _height * 3);
+void
+Image::unpack(const uint8_t *pixel, Vector3f &color) const
+{
+    if (_format == RGB8) {
+        for (int c = 0; c < 3; ++c) {
+            color[c] = pixel[c] / 255.0f;
+        }
+    } else if (_format == RGB16F) {
+        uint16_t h[3];
+        memcpy(h, pixel, sizeof(h));
+        for (int c = 0; c < 3; ++c) {
+            color[c] = halfToFloat(h[c]);
+        }
+    } else if (pixel[3] == 0) {
+        color = Vector3f::ZERO;
+    } else {
+        // Mantissas decode to the middle of their interval.
+        float scale = ldexpf(1.0f, pixel[3] - (128 + 8));
+        for (int c = 0; c < 3; ++c) {
+            color[c] = (pixel[c] + 0.5f) * scale;
+        }
+    }
+}
 
-    // flip y so that (0,0) is bottom left corner
-    for (int c = 0, y = _height - 1; y >= 0; y--) {
-        for (int x = 0; x < _width; x++) {
-            const Vector3f &pixel = getPixel(x, y);
-            buffer[c++] = clampColorComponent(pixel[0]);
-            buffer[c++] = clampColorComponent(pixel[1]);
-            buffer[c++] = clampColorComponent(pixel[2]);
+void
+Image::getRowRGB8(int y, uint8_t *out) const
+{
+    if (_data.empty()) {
+        memset(out, 0, 3 * (size_t)_width);
+        return;
+    }
+    y -= _firstRow;
+    assert(y >= 0 && y < _height);
+    const uint8_t *row = &_data[(size_t)y * _width * _pixelSize];
+    if (_format == RGB8) {
+        memcpy(out, row, 3 * (size_t)_width);
+        return;
+    }
+    Vector3f color;
+    for (int x = 0; x < _width; ++x, row += _pixelSize) {
+        if (_format == RGB32F) {
+            float rgb[3];
+            memcpy(rgb, row, sizeof(rgb));
+            color = Vector3f(rgb[0], rgb[1], rgb[2]);
+        } else {
+            unpack(row, color);
         }
+        *out++ = clampColorComponent(color[0]);
+        *out++ = clampColorComponent(color[1]);
+        *out++ = clampColorComponent(color[2]);
+    }
+}
+
+void
+Image::setAllPixels(const Vector3f &color)
+{
+    if (_data.empty()) {
+        return;
+    }
+    // Convert once, then copy the bytes.
+    setPixel(0, _firstRow, color);
+    for (size_t i = _pixelSize; i < _data.size(); i += _pixelSize) {
+        memcpy(&_data[i], &_data[0], _pixelSize);
     }
+}
+
+void
+Image::savePNG(const std::string &filename) const
+{
+    assert(!filename.empty());
+    assert(_firstRow == 0);
+
+    // FINAL PROJECT
+    // Encoded a row at a time, without a byte copy of the image.
+    ImageWriter writer(filename, _width, _height, ImageWriter::PNG);
+    writer.writeRows(*this, 0, _height);
+}
 
-    stbi_write_png(filename.c_str(), _width, _height, 3, &buffer[0], _width * 3);
+void
+Image::save(const std::string &filename) const
+{
+    assert(!filename.empty());
+    assert(_firstRow == 0);
+
+    ImageWriter writer(filename, _width, _height, ImageWriter::formatFor(filename));
+    writer.writeRows(*this, 0, _height);
 }
 
 Image 
@@ -56,17 +213,12 @@ Image::loadPNG(const std::string &filename)
     assert(buffer != NULL);
     assert(n == 3);
 
-    Image image(w, h);
+    // FINAL PROJECT
+    // Kept as bytes; getPixel returns the same byte / 255.0f as before.
+    Image image(w, h, RGB8);
 
-    // flip y so that (0,0) is bottom left corner
-    for (int c = 0, p = 0, y = h - 1; y >= 0; y--) {
-        for (int x = 0; x < w; x++, ++p) {
-            Vector3f &pixel = image._data[p];
-            pixel[0] = buffer[c++] / 255.0f;
-            pixel[1] = buffer[c++] / 255.0f;
-            pixel[2] = buffer[c++] / 255.0f;
-        }
-    }
+    // Rows stay in file order, as they did when this loaded floats.
+    memcpy(&image._data[0], buffer, (size_t)w * h * 3);
     stbi_image_free(buffer);
 
     return image;
@@ -2,23 +2,48 @@
 #define IMAGE_H
 
 #include <cassert>
+#include <cstring>
+#include <stdint.h>
 #include <string>
 #include <vector>
 
 #include "vecmath.h"
 
 // Simple image class
+//
+// FINAL PROJECT
+// An image without pixels (default constructed) ignores setPixel and
+// reads as black, so that the renderer can write all of its outputs and
+// only allocate the ones that were asked for.
+//
+// Pixels are stored in one of several formats. Colors are converted when
+// they are set and read back, so the renderer does not need to know which
+// one an image uses.
 class Image
 {
 public:
-    Image() : _width(0), _height(0) {}
+    // FINAL PROJECT
+    enum PixelFormat {
+        RGB32F,     // 3 floats, 12 bytes
+        RGB8,       // 3 bytes, clamped to [0, 1] as in a PNG file
+        RGB16F,     // 3 half floats, 6 bytes
+        RGBE        // 3 bytes sharing an 8-bit exponent (Radiance .hdr), 4 bytes
+    };
+
+    // Bytes per pixel of format.
+    static int pixelSize(PixelFormat format);
+
+    Image() : _width(0), _height(0), _firstRow(0), _format(RGB32F), _pixelSize(12) {}
     // Instantiate an image of given width and height
     // All pixels are set to black (0, 0, 0) by default.
-    Image(int w, int h)
+    Image(int w, int h, PixelFormat format = RGB32F)
     {
         _width = w;
         _height = h;
-        _data.resize(_width * _height);
+        _firstRow = 0;
+        _format = format;
+        _pixelSize = pixelSize(format);
+        _data.resize((size_t)_width * _height * _pixelSize);
     }
 
     // Return width of image
@@ -31,26 +56,62 @@ public:
         return _height;
     }
 
+    // FINAL PROJECT
+    PixelFormat getFormat() const {
+        return _format;
+    }
+
+    // FINAL PROJECT
+    // Makes the image a band of a taller one: it holds rows [y, y +
+    // getHeight()) of it, and setPixel and getPixel take row numbers of
+    // the taller image.
+    void setFirstRow(int y) {
+        _firstRow = y;
+    }
+
     // Set pixel to given RGB
     void setPixel(int x, int y, const Vector3f &color) {
+        if (_data.empty()) {
+            return;
+        }
+        y -= _firstRow;
         assert(x >= 0 && x < _width);
         assert(y >= 0 && y < _height);
-        _data[y * _width + x] = color;
+        uint8_t *pixel = &_data[((size_t)y * _width + x) * _pixelSize];
+        if (_format == RGB32F) {
+            float rgb[3] = { color[0], color[1], color[2] };
+            memcpy(pixel, rgb, sizeof(rgb));
+        } else {
+            pack(color, pixel);
+        }
     }
 
     // Return pixel at given x, y coordinates
-    const Vector3f & getPixel(int x, int y) const {
+    Vector3f getPixel(int x, int y) const {
+        if (_data.empty()) {
+            return Vector3f::ZERO;
+        }
+        y -= _firstRow;
         assert(x >= 0 && x < _width);
         assert(y >= 0 && y < _height);
-        return _data[y * _width + x];
+        const uint8_t *pixel = &_data[((size_t)y * _width + x) * _pixelSize];
+        if (_format == RGB32F) {
+            float rgb[3];
+            memcpy(rgb, pixel, sizeof(rgb));
+            return Vector3f(rgb[0], rgb[1], rgb[2]);
+        }
+        Vector3f color;
+        unpack(pixel, color);
+        return color;
     }
 
+    // FINAL PROJECT
+    // Writes row y as 8-bit RGB, the way PNG stores it, to out (3 *
+    // getWidth() bytes). RGB8 rows are copied as they are.
+    void getRowRGB8(int y, uint8_t *out) const;
+
     // Initialize all pixels in image to given RGB color.
-    void setAllPixels(const Vector3f &color) {
-        for (int i = 0; i < _width * _height; ++i) {
-            _data[i] = color;
-        }
-    }
+    void setAllPixels(const Vector3f &color);
 
     // Reads PNG image and return new image instance.
     static Image loadPNG(const std::string &filename);
@@ -58,13 +119,24 @@ public:
     // Save contents of image to given file name in PNG file format.
     void savePNG(const std::string &filename) const;
 
+    // FINAL PROJECT
+    // Saves as PFM (32-bit float) if filename ends in .pfm, else as PNG.
+    void save(const std::string &filename) const;
+
     // Return an absolute difference betweenthe given images
     static Image compare(const Image & img1, const Image & img2);
 
 private:
+    // Conversions for the formats other than RGB32F.
+    void pack(const Vector3f &color, uint8_t *pixel) const;
+    void unpack(const uint8_t *pixel, Vector3f &color) const;
+
     int _width;
     int _height;
-    std::vector<Vector3f> _data;
+    int _firstRow;
+    PixelFormat _format;
+    int _pixelSize;
+    std::vector<uint8_t> _data;
 };
 
 #endif // IMAGE_H
@@ -0,0 +1,350 @@
+#include "ImageWriter.h"
+
+#include "Image.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// Compressed bytes per IDAT chunk.
+static const size_t IDAT_SIZE = 1 << 16;
+
+static std::vector<uint32_t>
+crcTable() {
+    std::vector<uint32_t> table(256);
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k) {
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        table[n] = c;
+    }
+    return table;
+}
+
+// The CRC-32 that PNG chunks end with.
+static uint32_t
+crc32(uint32_t crc, const uint8_t *data, size_t size) {
+    static const std::vector<uint32_t> table = crcTable();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Fixed Huffman code of a deflate literal/length symbol (RFC 1951,
+// 3.2.6), bit-reversed because deflate sends codes starting from their
+// most significant bit.
+struct HuffmanCode {
+    uint32_t bits;
+    int length;
+};
+
+static HuffmanCode
+fixedCode(int symbol) {
+    uint32_t code;
+    int length;
+    if (symbol < 144) {
+        code = 0x30 + symbol;
+        length = 8;
+    } else if (symbol < 256) {
+        code = 0x190 + symbol - 144;
+        length = 9;
+    } else if (symbol < 280) {
+        code = symbol - 256;
+        length = 7;
+    } else {
+        code = 0xc0 + symbol - 280;
+        length = 8;
+    }
+    HuffmanCode h = { 0, length };
+    for (int i = 0; i < length; ++i) {
+        h.bits |= ((code >> i) & 1) << (length - 1 - i);
+    }
+    return h;
+}
+
+static std::vector<HuffmanCode>
+fixedCodes() {
+    std::vector<HuffmanCode> codes(288);
+    for (int s = 0; s < 288; ++s) {
+        codes[s] = fixedCode(s);
+    }
+    return codes;
+}
+
+// Match lengths of deflate length symbols 257-285 and their extra bits.
+static const int LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const int LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static int
+paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+static void
+putBigEndian(uint8_t *out, uint32_t v) {
+    out[0] = (uint8_t)(v >> 24);
+    out[1] = (uint8_t)(v >> 16);
+    out[2] = (uint8_t)(v >> 8);
+    out[3] = (uint8_t)v;
+}
+
+ImageWriter::Format
+ImageWriter::formatFor(const std::string &filename) {
+    size_t n = filename.size();
+    if (n >= 4) {
+        std::string ext = filename.substr(n - 4);
+        for (char &c : ext) {
+            c = (char)tolower(c);
+        }
+        if (ext == ".pfm") {
+            return PFM;
+        }
+    }
+    return PNG;
+}
+
+ImageWriter::ImageWriter(const std::string &filename, int width, int height, Format format) :
+    _filename(filename),
+    _file(fopen(filename.c_str(), "wb")),
+    _format(format),
+    _width(width),
+    _height(height),
+    _nextRow(height - 1),
+    _headerSize(0),
+    _failed(false),
+    _bits(0),
+    _bitCount(0),
+    _last(-1),
+    _adlerA(1),
+    _adlerB(0) {
+    if (!_file) {
+        std::cout << "Cannot write " << filename << std::endl;
+        return;
+    }
+    if (_format == PFM) {
+        // A negative scale means little-endian floats.
+        uint16_t one = 1;
+        bool little = *(uint8_t *)&one == 1;
+        fprintf(_file, "PF\n%d %d\n%s\n", _width, _height, little ? "-1.0" : "1.0");
+        _headerSize = ftell(_file);
+        return;
+    }
+
+    static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    _failed |= fwrite(signature, 1, 8, _file) != 8;
+    uint8_t header[13];
+    putBigEndian(header, (uint32_t)_width);
+    putBigEndian(header + 4, (uint32_t)_height);
+    header[8] = 8;      // bits per channel
+    header[9] = 2;      // RGB
+    header[10] = 0;     // deflate
+    header[11] = 0;     // adaptive filters
+    header[12] = 0;     // not interlaced
+    writeChunk("IHDR", header, sizeof(header));
+
+    _row.resize(3 * _width);
+    _previous.assign(3 * _width, 0);
+    for (int f = 0; f < 5; ++f) {
+        _filtered[f].resize(3 * _width + 1);
+        _filtered[f][0] = (uint8_t)f;
+    }
+    // zlib header (deflate, 32K window, no dictionary), then one fixed
+    // Huffman block that stays open until finish().
+    _idat.push_back(0x78);
+    _idat.push_back(0x01);
+    putBits(0, 1);
+    putBits(1, 2);
+}
+
+ImageWriter::~ImageWriter() {
+    finish();
+}
+
+void
+ImageWriter::writeChunk(const char *type, const uint8_t *data, size_t size) {
+    uint8_t word[4];
+    putBigEndian(word, (uint32_t)size);
+    _failed |= fwrite(word, 1, 4, _file) != 4;
+    _failed |= fwrite(type, 1, 4, _file) != 4;
+    if (size) {
+        _failed |= fwrite(data, 1, size, _file) != size;
+    }
+    uint32_t crc = crc32(0, (const uint8_t *)type, 4);
+    putBigEndian(word, crc32(crc, data, size));
+    _failed |= fwrite(word, 1, 4, _file) != 4;
+}
+
+void
+ImageWriter::putBits(uint32_t bits, int count) {
+    _bits |= (uint64_t)bits << _bitCount;
+    _bitCount += count;
+    while (_bitCount >= 8) {
+        _idat.push_back((uint8_t)_bits);
+        _bits >>= 8;
+        _bitCount -= 8;
+    }
+}
+
+void
+ImageWriter::putLiteral(int literal) {
+    static const std::vector<HuffmanCode> codes = fixedCodes();
+    const HuffmanCode &code = codes[literal];
+    putBits(code.bits, code.length);
+}
+
+void
+ImageWriter::putRun(int length) {
+    int i = 28;
+    while (LENGTH_BASE[i] > length) {
+        --i;
+    }
+    putLiteral(257 + i);
+    putBits(length - LENGTH_BASE[i], LENGTH_EXTRA[i]);
+    // Distance code 0: repeat the byte just before.
+    putBits(0, 5);
+}
+
+void
+ImageWriter::deflateRow(const uint8_t *data, size_t size) {
+    // zlib's Adler-32 of the uncompressed bytes; 5552 bytes is the most
+    // that can be added before the sums need reducing.
+    for (size_t i = 0; i < size; ) {
+        size_t end = std::min(size, i + 5552);
+        for (; i < end; ++i) {
+            _adlerA += data[i];
+            _adlerB += _adlerA;
+        }
+        _adlerA %= 65521;
+        _adlerB %= 65521;
+    }
+
+    for (size_t i = 0; i < size; ) {
+        if (data[i] == _last) {
+            size_t run = 1;
+            while (i + run < size && run < 258 && data[i + run] == data[i]) {
+                ++run;
+            }
+            if (run >= 3) {
+                putRun((int)run);
+                i += run;
+                continue;
+            }
+        }
+        putLiteral(data[i]);
+        _last = data[i];
+        ++i;
+    }
+    flushIDAT(false);
+}
+
+void
+ImageWriter::flushIDAT(bool all) {
+    size_t written = 0;
+    while (_idat.size() - written >= IDAT_SIZE || (all && written < _idat.size())) {
+        size_t size = std::min(IDAT_SIZE, _idat.size() - written);
+        writeChunk("IDAT", &_idat[written], size);
+        written += size;
+    }
+    _idat.erase(_idat.begin(), _idat.begin() + written);
+}
+
+void
+ImageWriter::writeRows(const Image &image, int y0, int y1) {
+    if (!_file) {
+        return;
+    }
+    if (_format == PFM) {
+        // PFM stores rows bottom to top, like Image.
+        std::vector<float> row(3 * _width);
+        for (int y = y0; y < y1; ++y) {
+            for (int x = 0; x < _width; ++x) {
+                Vector3f pixel = image.getPixel(x, y);
+                row[3 * x] = pixel[0];
+                row[3 * x + 1] = pixel[1];
+                row[3 * x + 2] = pixel[2];
+            }
+            _failed |= fseek(_file, _headerSize + (long)y * _width * 3 * sizeof(float), SEEK_SET) != 0;
+            _failed |= fwrite(&row[0], sizeof(float), row.size(), _file) != row.size();
+        }
+        return;
+    }
+
+    assert(y1 == _nextRow + 1);
+    for (int y = y1 - 1; y >= y0; --y) {
+        image.getRowRGB8(y, &_row[0]);
+
+        // Every filter, then the one whose bytes are closest to zero as
+        // signed values, the usual guess at what compresses best.
+        int n = 3 * _width;
+        int best = 0;
+        long bestSum = -1;
+        for (int f = 0; f < 5; ++f) {
+            uint8_t *out = &_filtered[f][1];
+            long sum = 0;
+            for (int i = 0; i < n; ++i) {
+                int a = i >= 3 ? _row[i - 3] : 0;
+                int b = _previous[i];
+                int c = i >= 3 ? _previous[i - 3] : 0;
+                int predicted = f == 0 ? 0 : f == 1 ? a : f == 2 ? b :
+                                f == 3 ? (a + b) / 2 : paeth(a, b, c);
+                out[i] = (uint8_t)(_row[i] - predicted);
+                sum += abs((int8_t)out[i]);
+            }
+            if (bestSum < 0 || sum < bestSum) {
+                best = f;
+                bestSum = sum;
+            }
+        }
+        deflateRow(&_filtered[best][0], n + 1);
+        _previous.swap(_row);
+    }
+    _nextRow = y0 - 1;
+}
+
+void
+ImageWriter::finish() {
+    if (!_file) {
+        return;
+    }
+    if (_format == PNG) {
+        if (_nextRow != -1) {
+            std::cout << _filename << ": " << _nextRow + 1 << " rows were never written" << std::endl;
+            _failed = true;
+        }
+        // End the open block, add an empty final one and the checksum.
+        putLiteral(256);
+        putBits(1, 1);
+        putBits(1, 2);
+        putLiteral(256);
+        if (_bitCount > 0) {
+            putBits(0, 8 - _bitCount);
+        }
+        uint8_t adler[4];
+        putBigEndian(adler, _adlerB << 16 | _adlerA);
+        _idat.insert(_idat.end(), adler, adler + 4);
+        flushIDAT(true);
+        writeChunk("IEND", NULL, 0);
+    }
+    _failed |= fclose(_file) != 0;
+    _file = NULL;
+    if (_failed) {
+        std::cout << "Error writing " << _filename << std::endl;
+    }
+}
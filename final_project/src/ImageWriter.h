@@ -0,0 +1,82 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <cstdio>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class Image;
+
+// FINAL PROJECT
+// Writes an image file a band of rows at a time, so that the renderer
+// never needs the whole frame (or a second copy of it as bytes) in
+// memory.
+//
+// PNG files are 8-bit RGB, compressed as they are written: each row gets
+// the PNG filter that leaves the smallest values, and the filtered bytes
+// are run-length coded with fixed Huffman codes. That is much faster than
+// a full deflate and still shrinks flat backgrounds and smooth shading to
+// a small fraction. PFM files hold the unclamped 32-bit float colors, for
+// HDR output.
+class ImageWriter
+{
+public:
+    enum Format { PNG, PFM };
+
+    // PFM if filename ends in ".pfm", PNG otherwise.
+    static Format formatFor(const std::string &filename);
+
+    // Opens filename and writes the header.
+    ImageWriter(const std::string &filename, int width, int height, Format format);
+    ~ImageWriter();
+
+    // False once the file could not be opened or written.
+    bool ok() const {
+        return _file && !_failed;
+    }
+
+    // Writes rows [y0, y1) of image, where y counts up from the bottom as
+    // in Image. image may hold only those rows (see Image::setFirstRow).
+    // PNG files are written top row first, so for PNG each call has to
+    // continue where the previous one stopped, starting at y1 = height;
+    // PFM rows can come in any order.
+    void writeRows(const Image &image, int y0, int y1);
+
+    // Ends the file and closes it; called by the destructor if needed.
+    // Prints a message if anything could not be written.
+    void finish();
+
+private:
+    void writeChunk(const char *type, const uint8_t *data, size_t size);
+    void deflateRow(const uint8_t *data, size_t size);
+    void putBits(uint32_t bits, int count);
+    void putLiteral(int literal);
+    void putRun(int length);
+    void flushIDAT(bool all);
+
+    std::string _filename;
+    FILE *_file;
+    Format _format;
+    int _width;
+    int _height;
+    int _nextRow;       // PNG: the next y to write
+    long _headerSize;   // PFM: where the rows start
+    bool _failed;
+
+    // PNG rows, unfiltered and filtered with each of the 5 filters.
+    std::vector<uint8_t> _row;
+    std::vector<uint8_t> _previous;
+    std::vector<uint8_t> _filtered[5];
+
+    // Deflate state: bits not yet written, the compressed bytes of the
+    // next IDAT chunk, the last byte coded and the zlib checksum.
+    uint64_t _bits;
+    int _bitCount;
+    std::vector<uint8_t> _idat;
+    int _last;
+    uint32_t _adlerA;
+    uint32_t _adlerB;
+};
+
+#endif // IMAGE_WRITER_H
@@ -0,0 +1,26 @@
+#ifndef KDNODE_H
+#define KDNODE_H
+
+#include <stdint.h>
+
+// FINAL PROJECT
+// Compact node of a FlatKDTree. Interior nodes store the split position,
+// the split axis and the index of their left child; the right child always
+// follows it in the node array. Leaves store where their triangle indices
+// start in FlatKDTree::indices and how many there are.
+struct KDNode {
+    union {
+        float split;       // interior
+        uint32_t offset;   // leaf: first entry in FlatKDTree::indices
+    };
+    // Low 2 bits: split axis, or 3 for a leaf.
+    // Upper 30 bits: index of the left child, or triangle count for a leaf.
+    uint32_t flags;
+
+    bool isLeaf() const { return (flags & 3) == 3; }
+    int axis() const { return flags & 3; }
+    uint32_t child() const { return flags >> 2; }
+    uint32_t count() const { return flags >> 2; }
+};
+
+#endif // KDNODE_H
@@ -1,7 +1,10 @@
 #include "Object3D.h"
 #include "KDTree.h"
+#include "Mesh.h"
+#include "ThreadPool.h"
 #include <limits>
 #include <algorithm>
+#include <cmath>
 #include <experimental/algorithm>
 #include <iostream>
 #include <random>
@@ -9,105 +12,161 @@
 
 bool PRINT_DEBUG = true;
 
-bool KDTree::traverse(const Ray &r, float tmin, Hit &h)
+void KDTree::splitBox(const BoundingBox &box, int splitDimension, float splitPosition,
+                      BoundingBox &boxLeft, BoundingBox &boxRight)
 {
-    vector<float> pathTimes = box.intersect(r);
-    if (pathTimes.empty())
-    {
-        return false;
-    }
-    float tstart = pathTimes[0];
-    float tend = pathTimes[1];
-    return traverse(r, tmin, h, tstart, tend);
+    boxLeft = BoundingBox(box.minBounds(), box.maxBounds());
+    boxRight = BoundingBox(box.minBounds(), box.maxBounds());
+    boxLeft.max[splitDimension] = splitPosition;
+    boxRight.min[splitDimension] = splitPosition;
+    assert(boxLeft.max[splitDimension] <= boxRight.min[splitDimension]);
 }
 
-bool KDTree::traverse(const Ray &r, float tmin, Hit &h, float tstart, float tend)
+void KDTree::sortTriangles(const vector<uint32_t> &triangles,
+                           const vector<BoundingBox> &boxes,
+                           int splitDimension, float splitPosition,
+                           vector<uint32_t> &trianglesLeft,
+                           vector<uint32_t> &trianglesRight)
 {
-    assert(tstart <= tend);
-    if (isLeaf)
+    for (uint32_t t : triangles)
     {
-        bool result = false;
-        for (Triangle *triangle : triangles)
+        if (boxes[t].min[splitDimension] <= splitPosition)
         {
-            result |= triangle->intersect(r, tmin, h);
-        }
-        return result;
-    }
-    else
-    {
-        // Find the intersection with the split axis
-        Vector3f orig = r.getOrigin();
-        Vector3f dir = r.getDirection();
-        // P = dt + O -> t = (P - O) / d
-        float t = (splitPosition - orig[splitDimension]) / (dir[splitDimension]);
-
-        KDTree *front, *back;
-        front = left;
-        back = right;
-        int belowFirst = (orig[splitDimension] < splitPosition) ||
-                         (orig[splitDimension] == splitPosition && dir[splitDimension] <= 0);
-        if (not belowFirst)
-            swap(front, back);
-
-        // 3 cases to check for
-        if (t <= tstart)
-        {
-            return back->traverse(r, tmin, h, tstart, tend);
-        }
-        else if (t >= tend or t < 0)
-        {
-            return front->traverse(r, tmin, h, tstart, tend);
+            trianglesLeft.push_back(t);
         }
-        else
+        if (boxes[t].max[splitDimension] >= splitPosition)
         {
-            if (front->traverse(r, tmin, h, tstart, t) and h.getT() < t)
-                /*
-                If front region already contains something,
-                terminate the search.
-                */
-                return true;
-            return back->traverse(r, tmin, h, t, tend);
+            trianglesRight.push_back(t);
         }
     }
 }
 
-void KDTree::splitBox(const BoundingBox &box, int splitDimension, float splitPosition,
-                      BoundingBox &boxLeft, BoundingBox &boxRight)
+float KDTree::traversalCost = 1.f;
+float KDTree::intersectionCost = 8.f;
+float KDTree::emptyBonus = 0.5f;
+int KDTree::maxLeafSize = 16;
+int KDTree::maxBadRefines = 3;
+
+bool KDTree::worthSplitting(float splitCost, int numTriangles, int &badRefines)
 {
-    boxLeft = BoundingBox(box.minBounds(), box.maxBounds());
-    boxRight = BoundingBox(box.minBounds(), box.maxBounds());
-    boxLeft.max[splitDimension] = splitPosition;
-    boxRight.min[splitDimension] = splitPosition;
-    assert(boxLeft.max[splitDimension] <= boxRight.min[splitDimension]);
+    if (splitCost <= intersectionCost * numTriangles)
+        return true;
+    badRefines++;
+    return numTriangles > maxLeafSize && badRefines <= maxBadRefines;
 }
 
-void KDTree::sortTriangles(vector<Triangle *> &triangles,
-                           int splitDimension, float splitPosition,
-                           vector<Triangle *> &trianglesLeft,
-                           vector<Triangle *> &trianglesRight)
+// One end of a triangle's extent along an axis, clipped to the node box.
+struct BoundEdge
 {
-    for (Triangle *t : triangles)
+    float position;
+    bool start;
+
+    bool operator<(const BoundEdge &e) const
     {
-        if (t->box.min[splitDimension] <= splitPosition)
+        if (position == e.position)
+            return start && !e.start; // starts sort before ends
+        return position < e.position;
+    }
+};
+
+bool KDTree::findSplit(const std::vector<uint32_t> &triangles,
+                       const std::vector<BoundingBox> &boxes,
+                       const BoundingBox &box,
+                       int &splitDimension, float &splitPosition,
+                       float &cost)
+{
+    // Sweep the sorted triangle extents along every axis and evaluate the
+    // SAH at each of them (PBRT 4.4.2).
+    float invArea = 1.f / box.surfaceArea();
+    int n = (int)triangles.size();
+    bool found = false;
+    cost = std::numeric_limits<float>::infinity();
+    std::vector<BoundEdge> edges(2 * n);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float lo = box.min[axis];
+        float hi = box.max[axis];
+        if (hi <= lo)
+            continue;
+        for (int i = 0; i < n; i++)
         {
-            trianglesLeft.push_back(t);
+            const BoundingBox &b = boxes[triangles[i]];
+            edges[2 * i].position = std::max(b.min[axis], lo);
+            edges[2 * i].start = true;
+            edges[2 * i + 1].position = std::min(b.max[axis], hi);
+            edges[2 * i + 1].start = false;
         }
-        if (t->box.max[splitDimension] >= splitPosition)
+        std::sort(edges.begin(), edges.end());
+
+        int other0 = (axis + 1) % 3, other1 = (axis + 2) % 3;
+        float d0 = box.d(other0), d1 = box.d(other1);
+        int nBelow = 0, nAbove = n;
+        for (const BoundEdge &e : edges)
         {
-            trianglesRight.push_back(t);
+            if (!e.start)
+                nAbove--;
+            if (e.position > lo && e.position < hi)
+            {
+                float areaBelow = 2 * (d0 * d1 + (e.position - lo) * (d0 + d1));
+                float areaAbove = 2 * (d0 * d1 + (hi - e.position) * (d0 + d1));
+                float bonus = (nBelow == 0 || nAbove == 0) ? emptyBonus : 0.f;
+                float c = traversalCost +
+                          intersectionCost * (1 - bonus) * invArea *
+                              (areaBelow * nBelow + areaAbove * nAbove);
+                if (c < cost)
+                {
+                    cost = c;
+                    splitDimension = axis;
+                    splitPosition = e.position;
+                    found = true;
+                }
+            }
+            if (e.start)
+                nBelow++;
         }
     }
+    return found;
 }
 
-KDTree *KDTree::buildTree(std::vector<Triangle *> triangles,
+KDTree *KDTree::buildTree(const std::vector<uint32_t> &triangles,
+                          const std::vector<BoundingBox> &boxes,
                           const BoundingBox &box,
-                          int splitDimension)
+                          int depth,
+                          int maxDepth,
+                          int badRefines)
 {
     if (!PRINT_DEBUG)
         cout.rdbuf(nullptr);
 
-    // Base case.
-    if (triangles.size() <= 21)
+    // Depth limit from PBRT: 8 + 1.3 log(N).
+    if (maxDepth < 0)
+        maxDepth = (int)std::round(8 + 1.3f * std::log2((float)std::max<size_t>(triangles.size(), 1)));
+
+    int splitDimension = 0;
+    float splitPosition = 0.f;
+    float splitCost = 0.f;
+    bool split = triangles.size() > 1 && depth < maxDepth &&
+                 findSplit(triangles, boxes, box, splitDimension, splitPosition, splitCost);
+
+    // Base case: stop when no split beats intersecting everything here,
+    // unless the node is still too large to be a good leaf.
+    if (split && !worthSplitting(splitCost, (int)triangles.size(), badRefines))
+        split = false;
+    std::vector<uint32_t> trianglesLeft, trianglesRight;
+    if (split)
+    {
+        // A split that does not separate anything only adds traversal work.
+        sortTriangles(triangles,
+                      boxes,
+                      splitDimension,
+                      splitPosition,
+                      trianglesLeft,
+                      trianglesRight);
+        if (trianglesLeft.size() == triangles.size() &&
+            trianglesRight.size() == triangles.size())
+            split = false;
+    }
+    if (!split)
     {
         // cout << "Leaf node, " << triangles.size() << endl;
         KDTree *leaf = new KDTree();
@@ -118,18 +177,6 @@ KDTree *KDTree::buildTree(std::vector<Triangle *> triangles,
     }
 
     // Recursive case: build subtrees.
-
-    assert(box.min[splitDimension] < box.max[splitDimension]); // segfault if not true!
-
-    // SPLITTING ALGORITHM: MIDPOINT
-    // Naively split at half of the current distance.
-    float splitPosition = box.min[splitDimension] + (box.d(splitDimension) / 2.f);
-    std::vector<Triangle *> trianglesLeft, trianglesRight;
-    sortTriangles(triangles,
-                  splitDimension,
-                  splitPosition,
-                  trianglesLeft,
-                  trianglesRight);
     BoundingBox boxLeft, boxRight;
     splitBox(box,
              splitDimension,
@@ -137,19 +184,578 @@ KDTree *KDTree::buildTree(std::vector<Triangle *> triangles,
              boxLeft,
              boxRight);
 
-    // Cycle through dimensions.
-    int nextDimension = 0;
-    if (box.dy() > box.dx())
-        nextDimension = 1;
-    if (nextDimension == 0 and box.dz() > box.dx())
-        nextDimension = 2;
-    if (nextDimension == 1 and box.dz() > box.dy())
-        nextDimension = 2;
     KDTree *root = new KDTree();
     root->splitDimension = splitDimension;
     root->splitPosition = splitPosition;
     root->box = box;
-    root->left = buildTree(trianglesLeft, boxLeft, nextDimension);
-    root->right = buildTree(trianglesRight, boxRight, nextDimension);
+    root->left = buildTree(trianglesLeft, boxes, boxLeft, depth + 1, maxDepth, badRefines);
+    root->right = buildTree(trianglesRight, boxes, boxRight, depth + 1, maxDepth, badRefines);
     return root;
-}
\ No newline at end of file
+}
+
+// EVENT-SORTED BUILD
+// Every triangle contributes, per axis, either a start and an end event
+// (the two faces of its box clipped to the node) or a single planar event
+// when the clipped box is flat along that axis.
+enum KDEventType
+{
+    KD_END = 0,
+    KD_PLANAR = 1,
+    KD_START = 2
+};
+
+struct KDEvent
+{
+    float position;
+    int triangle;
+    unsigned char axis;
+    unsigned char type;
+
+    // Events are grouped by axis, then sorted by position, with ends before
+    // planars before starts at the same position.
+    bool operator<(const KDEvent &e) const
+    {
+        if (axis != e.axis)
+            return axis < e.axis;
+        if (position != e.position)
+            return position < e.position;
+        return type < e.type;
+    }
+};
+
+enum KDSide
+{
+    KD_BOTH = 0,
+    KD_LEFT_ONLY = 1,
+    KD_RIGHT_ONLY = 2
+};
+
+// Adds the events of a triangle whose box, clipped to the current node, is
+// [lo, hi]. Works on plain floats: this runs for every straddling triangle
+// at every level of the tree.
+static void addEvents(int triangle, const float lo[3], const float hi[3],
+                      std::vector<KDEvent> &events)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        KDEvent e;
+        e.triangle = triangle;
+        e.axis = (unsigned char)axis;
+        if (lo[axis] == hi[axis])
+        {
+            e.position = lo[axis];
+            e.type = KD_PLANAR;
+            events.push_back(e);
+        }
+        else
+        {
+            e.position = lo[axis];
+            e.type = KD_START;
+            events.push_back(e);
+            e.position = hi[axis];
+            e.type = KD_END;
+            events.push_back(e);
+        }
+    }
+}
+
+static void addClippedEvents(int triangle, const BoundingBox &b,
+                             const float nodeLo[3], const float nodeHi[3],
+                             std::vector<KDEvent> &events)
+{
+    float lo[3], hi[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        lo[axis] = std::max(b.min[axis], nodeLo[axis]);
+        hi[axis] = std::min(b.max[axis], nodeHi[axis]);
+    }
+    addEvents(triangle, lo, hi, events);
+}
+
+// SAH cost of splitting box at position along axis; planar triangles go
+// to whichever side is cheaper.
+static float splitCost(const BoundingBox &box, int axis, float position,
+                       int nLeft, int nPlanar, int nRight,
+                       bool &planarLeft)
+{
+    float lo = box.min[axis], hi = box.max[axis];
+    int other0 = (axis + 1) % 3, other1 = (axis + 2) % 3;
+    float d0 = box.d(other0), d1 = box.d(other1);
+    float invArea = 1.f / box.surfaceArea();
+    float pLeft = 2 * (d0 * d1 + (position - lo) * (d0 + d1)) * invArea;
+    float pRight = 2 * (d0 * d1 + (hi - position) * (d0 + d1)) * invArea;
+
+    float cost[2];
+    for (int side = 0; side < 2; side++)
+    {
+        int l = nLeft + (side == 0 ? nPlanar : 0);
+        int r = nRight + (side == 1 ? nPlanar : 0);
+        float bonus = (l == 0 || r == 0) ? KDTree::emptyBonus : 0.f;
+        cost[side] = KDTree::traversalCost +
+                     KDTree::intersectionCost * (1 - bonus) * (pLeft * l + pRight * r);
+    }
+    planarLeft = cost[0] <= cost[1];
+    return planarLeft ? cost[0] : cost[1];
+}
+
+// Subtrees with fewer triangles than this are never handed to the pool.
+static const int MIN_PARALLEL_TRIANGLES = 1024;
+
+// Recursive step of buildTreeSorted. events holds the sorted events of the
+// n triangles overlapping box; side is scratch space indexed by triangle.
+// Above taskDepth both children are built as pool tasks; the right one
+// gets its own side array, since triangles straddling the split are in
+// both.
+static KDTree *buildFromEvents(std::vector<KDEvent> &events, int n,
+                               const BoundingBox &box,
+                               int depth, int maxDepth, int badRefines,
+                               const std::vector<BoundingBox> &boxes,
+                               std::vector<unsigned char> &side,
+                               ThreadPool *pool, int taskDepth)
+{
+    // Find the cheapest plane with one linear sweep over the events.
+    int splitDimension = 0;
+    float splitPosition = 0.f;
+    bool splitPlanarLeft = true;
+    float bestCost = std::numeric_limits<float>::infinity();
+    bool found = false;
+    if (n > 1 && depth < maxDepth)
+    {
+        size_t i = 0;
+        while (i < events.size())
+        {
+            int axis = events[i].axis;
+            int nLeft = 0, nPlanar = 0, nRight = n;
+            while (i < events.size() && events[i].axis == axis)
+            {
+                float position = events[i].position;
+                int ends = 0, planars = 0, starts = 0;
+                while (i < events.size() && events[i].axis == axis &&
+                       events[i].position == position && events[i].type == KD_END)
+                {
+                    ends++;
+                    i++;
+                }
+                while (i < events.size() && events[i].axis == axis &&
+                       events[i].position == position && events[i].type == KD_PLANAR)
+                {
+                    planars++;
+                    i++;
+                }
+                while (i < events.size() && events[i].axis == axis &&
+                       events[i].position == position && events[i].type == KD_START)
+                {
+                    starts++;
+                    i++;
+                }
+                nPlanar = planars;
+                nRight -= planars + ends;
+                if (position > box.min[axis] && position < box.max[axis])
+                {
+                    bool planarLeft;
+                    float c = splitCost(box, axis, position,
+                                        nLeft, nPlanar, nRight, planarLeft);
+                    if (c < bestCost)
+                    {
+                        bestCost = c;
+                        splitDimension = axis;
+                        splitPosition = position;
+                        splitPlanarLeft = planarLeft;
+                        found = true;
+                    }
+                }
+                nLeft += starts + planars;
+                nPlanar = 0;
+            }
+        }
+    }
+
+    // Same termination rule as buildTree.
+    bool split = found;
+    if (split && !KDTree::worthSplitting(bestCost, n, badRefines))
+        split = false;
+
+    // Classify triangles against the chosen plane.
+    int nLeftOnly = 0, nRightOnly = 0;
+    if (split)
+    {
+        for (const KDEvent &e : events)
+            side[e.triangle] = KD_BOTH;
+        for (const KDEvent &e : events)
+        {
+            if (e.axis != splitDimension)
+                continue;
+            if (e.type == KD_END && e.position <= splitPosition)
+                side[e.triangle] = KD_LEFT_ONLY;
+            else if (e.type == KD_START && e.position >= splitPosition)
+                side[e.triangle] = KD_RIGHT_ONLY;
+            else if (e.type == KD_PLANAR)
+            {
+                if (e.position < splitPosition ||
+                    (e.position == splitPosition && splitPlanarLeft))
+                    side[e.triangle] = KD_LEFT_ONLY;
+                else
+                    side[e.triangle] = KD_RIGHT_ONLY;
+            }
+        }
+        for (const KDEvent &e : events)
+        {
+            // Count each triangle once, on its first event along x.
+            if (e.axis != 0 || e.type == KD_END)
+                continue;
+            if (side[e.triangle] == KD_LEFT_ONLY)
+                nLeftOnly++;
+            else if (side[e.triangle] == KD_RIGHT_ONLY)
+                nRightOnly++;
+        }
+        // A split that does not separate anything only adds traversal work.
+        if (nLeftOnly == 0 && nRightOnly == 0)
+            split = false;
+    }
+
+    if (!split)
+    {
+        KDTree *leaf = new KDTree();
+        leaf->isLeaf = true;
+        leaf->box = box;
+        leaf->triangles.reserve(n);
+        for (const KDEvent &e : events)
+        {
+            if (e.axis == 0 && e.type != KD_END)
+                leaf->triangles.push_back((uint32_t)e.triangle);
+        }
+        return leaf;
+    }
+
+    BoundingBox boxLeft(box.min, box.max), boxRight(box.min, box.max);
+    boxLeft.max[splitDimension] = splitPosition;
+    boxRight.min[splitDimension] = splitPosition;
+
+    // Events of triangles that land on one side stay sorted; triangles
+    // straddling the plane get fresh events from their box clipped to
+    // each child, which are sorted separately and merged in.
+    std::vector<KDEvent> leftOnly, rightOnly, leftNew, rightNew;
+    leftOnly.reserve(events.size());
+    rightOnly.reserve(events.size());
+    for (const KDEvent &e : events)
+    {
+        if (side[e.triangle] == KD_LEFT_ONLY)
+            leftOnly.push_back(e);
+        else if (side[e.triangle] == KD_RIGHT_ONLY)
+            rightOnly.push_back(e);
+    }
+    float leftLo[3], leftHi[3], rightLo[3], rightHi[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        leftLo[axis] = rightLo[axis] = box.min[axis];
+        leftHi[axis] = rightHi[axis] = box.max[axis];
+    }
+    leftHi[splitDimension] = rightLo[splitDimension] = splitPosition;
+    int nBoth = 0;
+    for (const KDEvent &e : events)
+    {
+        if (e.axis != 0 || e.type == KD_END || side[e.triangle] != KD_BOTH)
+            continue;
+        const BoundingBox &b = boxes[e.triangle];
+        addClippedEvents(e.triangle, b, leftLo, leftHi, leftNew);
+        addClippedEvents(e.triangle, b, rightLo, rightHi, rightNew);
+        nBoth++;
+    }
+    std::vector<KDEvent>().swap(events);
+
+    std::sort(leftNew.begin(), leftNew.end());
+    std::sort(rightNew.begin(), rightNew.end());
+    std::vector<KDEvent> eventsLeft(leftOnly.size() + leftNew.size());
+    std::merge(leftOnly.begin(), leftOnly.end(), leftNew.begin(), leftNew.end(),
+               eventsLeft.begin());
+    std::vector<KDEvent>().swap(leftOnly);
+    std::vector<KDEvent>().swap(leftNew);
+    std::vector<KDEvent> eventsRight(rightOnly.size() + rightNew.size());
+    std::merge(rightOnly.begin(), rightOnly.end(), rightNew.begin(), rightNew.end(),
+               eventsRight.begin());
+    std::vector<KDEvent>().swap(rightOnly);
+    std::vector<KDEvent>().swap(rightNew);
+
+    KDTree *root = new KDTree();
+    root->splitDimension = splitDimension;
+    root->splitPosition = splitPosition;
+    root->box = box;
+    if (depth < taskDepth && n >= MIN_PARALLEL_TRIANGLES)
+    {
+        std::vector<unsigned char> rightSide(side.size(), KD_BOTH);
+        pool->parallelFor(2, [&](int child) {
+            if (child == 0)
+                root->left = buildFromEvents(eventsLeft, nLeftOnly + nBoth, boxLeft,
+                                             depth + 1, maxDepth, badRefines, boxes, side,
+                                             pool, taskDepth);
+            else
+                root->right = buildFromEvents(eventsRight, nRightOnly + nBoth, boxRight,
+                                              depth + 1, maxDepth, badRefines, boxes, rightSide,
+                                              pool, taskDepth);
+        });
+        return root;
+    }
+    root->left = buildFromEvents(eventsLeft, nLeftOnly + nBoth, boxLeft,
+                                 depth + 1, maxDepth, badRefines, boxes, side,
+                                 pool, taskDepth);
+    root->right = buildFromEvents(eventsRight, nRightOnly + nBoth, boxRight,
+                                  depth + 1, maxDepth, badRefines, boxes, side,
+                                  pool, taskDepth);
+    return root;
+}
+
+KDTree *KDTree::buildTreeSorted(const std::vector<BoundingBox> &boxes,
+                                const BoundingBox &box,
+                                ThreadPool *pool)
+{
+    int n = (int)boxes.size();
+    float lo[3], hi[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        lo[axis] = box.min[axis];
+        hi[axis] = box.max[axis];
+    }
+    std::vector<KDEvent> events;
+    events.reserve(6 * n);
+    for (int i = 0; i < n; i++)
+        addClippedEvents(i, boxes[i], lo, hi, events);
+    std::sort(events.begin(), events.end());
+
+    // Depth limit from PBRT: 8 + 1.3 log(N).
+    int maxDepth = (int)std::round(8 + 1.3f * std::log2((float)std::max(n, 1)));
+    std::vector<unsigned char> side(n, KD_BOTH);
+    int taskDepth = pool ? pool->taskDepth(2) : 0;
+    return buildFromEvents(events, n, box, 0, maxDepth, 0, boxes, side, pool, taskDepth);
+}
+
+void FlatKDTree::build(const KDTree *root, const Mesh &mesh)
+{
+    nodes.clear();
+    indices.clear();
+    box = root->box;
+    nodes.push_back(KDNode());
+    flatten(root, 0);
+    buildPacketTriangles(mesh);
+}
+
+void FlatKDTree::buildPacketTriangles(const Mesh &mesh)
+{
+    packetTriangles.clear();
+    packetTriangles.reserve(9 * (size_t)mesh.numTriangles());
+    for (int t = 0; t < mesh.numTriangles(); t++)
+    {
+        const Vector3f &v0 = mesh.getVertex(t, 0);
+        Vector3f e1 = mesh.getVertex(t, 1) - v0;
+        Vector3f e2 = mesh.getVertex(t, 2) - v0;
+        packetTriangles.insert(packetTriangles.end(),
+                               {v0[0], v0[1], v0[2], e1[0], e1[1], e1[2], e2[0], e2[1], e2[2]});
+    }
+}
+
+void FlatKDTree::flatten(const KDTree *node, uint32_t slot)
+{
+    if (node->isLeaf)
+    {
+        nodes[slot].offset = (uint32_t)indices.size();
+        nodes[slot].flags = ((uint32_t)node->triangles.size() << 2) | 3;
+        indices.insert(indices.end(), node->triangles.begin(), node->triangles.end());
+        return;
+    }
+    // Reserve both children next to each other before descending.
+    uint32_t child = (uint32_t)nodes.size();
+    nodes.push_back(KDNode());
+    nodes.push_back(KDNode());
+    nodes[slot].split = node->splitPosition;
+    nodes[slot].flags = (child << 2) | (uint32_t)node->splitDimension;
+    flatten(node->left, child);
+    flatten(node->right, child + 1);
+}
+
+bool FlatKDTree::intersect(const Ray &r, float tmin, Hit &h, const Mesh &mesh) const
+{
+    float tstart, tend;
+    if (!box.intersect(r, tstart, tend))
+        return false;
+
+    // Nodes still to visit, with the ray interval inside each of them.
+    struct Entry
+    {
+        uint32_t node;
+        float tstart, tend;
+    } stack[MAX_DEPTH];
+    int top = 0;
+    Stats::Visits visits;
+
+    bool result = false;
+    uint32_t current = 0;
+    while (true)
+    {
+        // Anything left on the stack lies behind the closest hit so far.
+        if (h.getT() < tstart)
+            break;
+        const KDNode &node = nodes[current];
+        if (!node.isLeaf())
+        {
+            visits.nodes++;
+            int axis = node.axis();
+            float orig = r.orig[axis];
+            float dir = r.dir[axis];
+            float t = (node.split - orig) * r.invdir[axis];
+            uint32_t front = node.child(), back = node.child() + 1;
+            bool belowFirst = (orig < node.split) ||
+                              (orig == node.split && dir <= 0);
+            if (!belowFirst)
+                std::swap(front, back);
+
+            // Same 3 cases as KDTree::traverse.
+            if (t >= tend || t <= 0)
+            {
+                current = front;
+            }
+            else if (t <= tstart)
+            {
+                current = back;
+            }
+            else
+            {
+                assert(top < MAX_DEPTH);
+                stack[top].node = back;
+                stack[top].tstart = t;
+                stack[top].tend = tend;
+                top++;
+                current = front;
+                tend = t;
+            }
+        }
+        else
+        {
+            visits.leaves++;
+            const uint32_t *index = &indices[node.offset];
+            for (uint32_t i = 0; i < node.count(); i++)
+                result |= mesh.intersectTrig(index[i], r, tmin, h);
+            if (top == 0)
+                break;
+            top--;
+            current = stack[top].node;
+            tstart = stack[top].tstart;
+            tend = stack[top].tend;
+        }
+    }
+    return result;
+}
+
+bool FlatKDTree::occluded(const Ray &r, float tmin, float tmax, const Mesh &mesh) const
+{
+    float tstart, tend;
+    if (!box.intersect(r, tstart, tend) || tstart > tmax || tend < tmin)
+        return false;
+    // Nothing past tmax matters, so the walk can stop there.
+    tend = std::min(tend, tmax);
+
+    struct Entry
+    {
+        uint32_t node;
+        float tstart, tend;
+    } stack[MAX_DEPTH];
+    int top = 0;
+    Stats::Visits visits;
+
+    uint32_t current = 0;
+    while (true)
+    {
+        const KDNode &node = nodes[current];
+        if (!node.isLeaf())
+        {
+            visits.nodes++;
+            // Same traversal as intersect.
+            int axis = node.axis();
+            float orig = r.orig[axis];
+            float dir = r.dir[axis];
+            float t = (node.split - orig) * r.invdir[axis];
+            uint32_t front = node.child(), back = node.child() + 1;
+            bool belowFirst = (orig < node.split) ||
+                              (orig == node.split && dir <= 0);
+            if (!belowFirst)
+                std::swap(front, back);
+
+            if (t >= tend || t <= 0)
+            {
+                current = front;
+            }
+            else if (t <= tstart)
+            {
+                current = back;
+            }
+            else
+            {
+                assert(top < MAX_DEPTH);
+                stack[top].node = back;
+                stack[top].tstart = t;
+                stack[top].tend = tend;
+                top++;
+                current = front;
+                tend = t;
+            }
+        }
+        else
+        {
+            visits.leaves++;
+            const uint32_t *index = &indices[node.offset];
+            for (uint32_t i = 0; i < node.count(); i++)
+                if (mesh.occludedTrig(index[i], r, tmin, tmax))
+                    return true;
+            if (top == 0)
+                break;
+            top--;
+            current = stack[top].node;
+            tstart = stack[top].tstart;
+            tend = stack[top].tend;
+        }
+    }
+    return false;
+}
+
+static_assert(PacketScene::MAX_DEPTH == FlatKDTree::MAX_DEPTH,
+              "packet kernels need the same stack depth as FlatKDTree");
+
+int FlatKDTree::intersectPacket(const RayPacket &packet, float tmin, Hit *hits,
+                                const Mesh &mesh) const
+{
+    int width = packetWidth();
+    if (!packet.coherent || packet.size > width || width < 4)
+    {
+        int mask = 0;
+        for (int i = 0; i < packet.size; i++)
+            if (intersect(packet.rays[i], tmin, hits[i], mesh))
+                mask |= 1 << i;
+        return mask;
+    }
+
+    PacketScene scene;
+    scene.nodes = &nodes[0];
+    scene.indices = indices.empty() ? NULL : &indices[0];
+    scene.triangles = packetTriangles.empty() ? NULL : &packetTriangles[0];
+    for (int a = 0; a < 3; a++)
+    {
+        scene.boxMin[a] = box.min[a];
+        scene.boxMax[a] = box.max[a];
+    }
+    PacketHits packetHits;
+    for (int i = 0; i < RayPacket::MAX_SIZE; i++)
+    {
+        packetHits.t[i] = i < packet.size ? hits[i].getT() : 0;
+        packetHits.beta[i] = packetHits.gamma[i] = 0;
+    }
+    int mask = packet.size <= 4 ?
+        intersectPacket4(scene, packet, tmin, packetHits) :
+        intersectPacket8(scene, packet, tmin, packetHits);
+    Stats::count(Stats::BOX_TESTS);
+    Stats::count(Stats::NODE_VISITS, packetHits.nodeVisits);
+    Stats::count(Stats::LEAF_VISITS, packetHits.leafVisits);
+    Stats::count(Stats::TRIANGLE_TESTS, packetHits.triangleTests);
+    for (int i = 0; i < packet.size; i++)
+        if (mask & (1 << i))
+            mesh.setTrigHit(packetHits.triangle[i],
+                            hits[i], packetHits.t[i], packetHits.beta[i], packetHits.gamma[i]);
+    return mask;
+}
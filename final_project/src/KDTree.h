@@ -6,6 +6,12 @@
 #include <Vector3f.h>
 #include "Object3D.h"
 #include <limits>
+#include <stdint.h>
+#include "KDNode.h"
+#include "Packet.h"
+
+class Mesh;
+class ThreadPool;
 
 // FINAL PROJECT
 class KDTree {
@@ -14,34 +20,117 @@ public:
     // CONSTRUCTOR
 
     KDTree() {};
+    // Deletes the subtree.
+    ~KDTree()
+    {
+        delete left;
+        delete right;
+    }
 
     // ATTRIBUTES
 
-    KDTree *left, *right; // children
+    KDTree *left = NULL, *right = NULL; // children
     int splitDimension = 0; // either X, Y, or Z axis
     float splitPosition; // from origin along split axis
     bool isLeaf = false;
-    std::vector<Triangle *> triangles; // only leaves have lists of triangles
+    std::vector<uint32_t> triangles; // only leaves have lists of triangles
     BoundingBox box; // box partition for this node
 
-    // FUNCTIONS
+    // SURFACE AREA HEURISTIC
+    // Expected cost of a node = traversalCost + intersectionCost *
+    // (P(left) * |left| + P(right) * |right|), where P is the ratio of the
+    // child's surface area to the parent's. Splits that leave one side
+    // empty get their cost scaled by (1 - emptyBonus).
+    static float traversalCost;
+    static float intersectionCost;
+    static float emptyBonus;
+    // Termination: a node becomes a leaf when its best split costs more
+    // than intersecting all of its triangles. Nodes larger than maxLeafSize
+    // may still take up to maxBadRefines such splits along a path, since
+    // splits further down can pay for them.
+    static int maxLeafSize;
+    static int maxBadRefines;
+    static bool worthSplitting(float splitCost, int numTriangles, int &badRefines);
 
-    bool traverse(const Ray &r, float tmin, Hit &h);
-    bool traverse(const Ray &r, float tmin, Hit &h, float tstart, float tend);
+    // FUNCTIONS
+    // Triangles are indices into boxes, which holds the bounding box of
+    // every triangle of the mesh. FlatKDTree does the traversal.
 
-    void sortTriangles(std::vector<Triangle *> &triangles,
+    void sortTriangles(const std::vector<uint32_t> &triangles,
+                       const std::vector<BoundingBox> &boxes,
                        int splitDimension, float splitPosition,
-                       std::vector<Triangle *> &trianglesLeft,
-                       std::vector<Triangle *> &trianglesRight);
+                       std::vector<uint32_t> &trianglesLeft,
+                       std::vector<uint32_t> &trianglesRight);
 
     void splitBox(const BoundingBox &box, int splitDimension, float splitPosition,
                   BoundingBox &boxLeft, BoundingBox &boxRight);
 
-    KDTree *buildTree(std::vector<Triangle *> triangles,
+    bool findSplit(const std::vector<uint32_t> &triangles,
+                   const std::vector<BoundingBox> &boxes,
+                   const BoundingBox &box,
+                   int &splitDimension, float &splitPosition,
+                   float &cost);
+
+    // maxDepth < 0 derives the depth limit from the number of triangles.
+    KDTree *buildTree(const std::vector<uint32_t> &triangles,
+                      const std::vector<BoundingBox> &boxes,
                       const BoundingBox &box,
-                      int splitDimension
+                      int depth = 0,
+                      int maxDepth = -1,
+                      int badRefines = 0
                       );
 
+    // SAH build with the same cost model and termination rule as
+    // buildTree, but sorts the split candidates once up front and
+    // partitions them down the recursion instead of re-sorting at every
+    // node: O(N log N) overall (Wald & Havran 2006). The trees can differ:
+    // this build also tries planes that triangles lie in and puts such
+    // triangles on the cheaper side, and breaks ties between equal
+    // positions differently. Takes all triangles of boxes. The top of the
+    // tree is split into subtrees built in parallel on pool, if given; the
+    // tree is the same as without.
+    KDTree *buildTreeSorted(const std::vector<BoundingBox> &boxes,
+                            const BoundingBox &box,
+                            ThreadPool *pool = NULL);
+
+};
+
+// FINAL PROJECT
+// Cache-friendly copy of a KDTree: all nodes live in one array and all leaf
+// triangle indices in another, so traversal walks contiguous memory with
+// an explicit stack instead of recursing through heap-allocated nodes.
+class FlatKDTree {
+public:
+    // Deepest tree the traversal stack can handle. KDTree limits itself to
+    // 8 + 1.3 log2(N) levels, which stays below this for any mesh that
+    // fits in memory.
+    static const int MAX_DEPTH = 64;
+
+    // mesh holds the triangles the tree's indices refer to.
+    void build(const KDTree *root, const Mesh &mesh);
+
+    // Fills packetTriangles; build does this too.
+    void buildPacketTriangles(const Mesh &mesh);
+
+    bool intersect(const Ray &r, float tmin, Hit &h, const Mesh &mesh) const;
+
+    // Any-hit query: true if some triangle is hit with t in [tmin, tmax).
+    bool occluded(const Ray &r, float tmin, float tmax, const Mesh &mesh) const;
+
+    // Traces a packet with the SSE or AVX2 kernel when it is coherent and
+    // the CPU supports its width, and ray by ray otherwise. Same results as
+    // calling intersect on every ray. Returns a mask of the lanes that hit.
+    int intersectPacket(const RayPacket &packet, float tmin, Hit *hits,
+                        const Mesh &mesh) const;
+
+    std::vector<KDNode> nodes;
+    std::vector<uint32_t> indices;
+    // Vertex 0 and both edges of every triangle, for the packet kernels.
+    std::vector<float> packetTriangles;
+    BoundingBox box;
+
+private:
+    void flatten(const KDTree *node, uint32_t slot);
 };
 
 #endif // KDTREE_H
@@ -1,96 +1,46 @@
 #include "Mesh.h"
 
-#include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <utility>
-#include <sstream>
 #include "KDTree.h"
+#include "MeshCache.h"
+#include "ObjFile.h"
 
-Mesh::Mesh(const std::string &filename, Material *material) : Object3D(material)
+Mesh::Mesh(const std::string &filename, Material *material, MeshAccel accel,
+           ThreadPool *pool) :
+    Object3D(material),
+    _accel(accel)
 {
     isMesh = true;
-    std::ifstream f;
-    f.open(filename.c_str());
-    if (!f.is_open())
+    box = BoundingBox(Vector3f(INFINITY), Vector3f(-INFINITY));
+    Stats::Timer loadTimer(Stats::MESH_LOAD);
+    MeshCache cache(filename, _accel);
+    if (cache.load(*this))
     {
-        std::cout << "Cannot open " << filename << "\n";
+        if (Stats::enabled)
+            cout << filename << " mesh size: " << numTriangles() << " (cached)" << endl;
+        loadTimer.stop();
+        // The octree points into the mesh, so it is rebuilt rather than cached.
+        if (_accel == ACCEL_OCTREE)
+        {
+            Stats::Timer buildTimer(Stats::ACCEL_BUILD);
+            octree.build(this, pool);
+        }
         return;
     }
-    // cout << "mesh file " << filename.c_str() << endl;
 
-    std::vector<Vector3f> v;
-    std::vector<ObjTriangle> t;
-    std::vector<Vector3f> n;
-    std::vector<Vector2f> texCoord;
-
-    const std::string vTok("v");
-    const std::string fTok("f");
-    const std::string texTok("vt");
-    const char bslash = '/', space = ' ';
-    std::string tok;
-    std::string line;
-    while (true)
+    ObjFile obj;
+    if (!obj.read(filename, pool))
     {
-        std::getline(f, line);
-        if (f.eof())
-        {
-            break;
-        }
-        if (line.size() < 3)
-        {
-            continue;
-        }
-        if (line.at(0) == '#')
-        {
-            continue;
-        }
-        std::stringstream ss(line);
-        ss >> tok;
-        if (tok == vTok)
-        {
-            Vector3f vec;
-            ss >> vec[0] >> vec[1] >> vec[2];
-            v.push_back(vec);
-        }
-        else if (tok == fTok)
-        {
-            if (line.find(bslash) != std::string::npos)
-            {
-                std::replace(line.begin(), line.end(), bslash, space);
-                std::stringstream facess(line);
-                ObjTriangle trig;
-                facess >> tok;
-                for (int ii = 0; ii < 3; ii++)
-                {
-                    facess >> trig[ii] >> trig.texID[ii];
-                    trig[ii]--;
-                    trig.texID[ii]--;
-                }
-                t.push_back(trig);
-            }
-            else
-            {
-                ObjTriangle trig;
-                for (int ii = 0; ii < 3; ii++)
-                {
-                    ss >> trig[ii];
-                    trig[ii]--;
-                    trig.texID[ii] = 0;
-                }
-                t.push_back(trig);
-            }
-        }
-        else if (tok == texTok)
-        {
-            Vector2f texcoord;
-            ss >> texcoord[0];
-            ss >> texcoord[1];
-            texCoord.push_back(texcoord);
-        }
+        std::cout << "Cannot open " << filename << "\n";
+        return;
     }
-    f.close();
+    const std::vector<Vector3f> &v = obj.vertices;
+    std::vector<ObjTriangle> &t = obj.triangles;
+    std::vector<Vector3f> &n = _normals;
 
     // Compute normals
     // will smooth normals.
@@ -112,56 +62,125 @@ Mesh::Mesh(const std::string &filename, Material *material) : Object3D(material)
     }
 
     // Set up triangles
+    _indices.reserve(3 * t.size());
     for (int i = 0; i < t.size(); i++)
     {
-        Triangle triangle(v[t[i][0]],
-                          v[t[i][1]],
-                          v[t[i][2]],
-                          n[t[i][0]],
-                          n[t[i][1]],
-                          n[t[i][2]],
-                          getMaterial());
-        _triangles.push_back(triangle);
+        for (int jj = 0; jj < 3; jj++)
+        {
+            _indices.push_back((uint32_t)t[i][jj]);
+        }
     }
+    _vertices.swap(obj.vertices);
+
+    // Per-mesh details go with -stats, which also has the phase totals.
+    if (Stats::enabled)
+        cout << filename << " mesh size: " << numTriangles() << endl;
+    loadTimer.stop();
+    computeBox();
 
-    cout << filename << " mesh size: " << _triangles.size() << endl;
+    // Only build the structure that intersect will use (-accel), on the
+    // renderer's thread pool.
+    Stats::Timer buildTimer(Stats::ACCEL_BUILD);
+    auto buildStart = std::chrono::steady_clock::now();
+    const char *name = "";
+    if (_accel == ACCEL_KDTREE)
+    {
+        // Event-sorted SAH build; buildTree uses the same cost model but
+        // re-sorts the candidates at every node, and may split elsewhere.
+        name = "kd tree";
+        std::vector<BoundingBox> boxes = trigBoxes();
+        KDTree *root = KDTree().buildTreeSorted(boxes, box, pool);
+#ifndef NDEBUG
+        // Walks the tree once per triangle; about a tenth of the build.
+        checkTrianglesInKDTree(root, boxes);
+#endif
+        // Only the flat copy is kept.
+        flatKD.build(root, *this);
+        delete root;
+    }
+    else if (_accel == ACCEL_BVH)
+    {
+        name = "bvh";
+        bvh.build(trigBoxes(), pool);
+    }
+    else if (_accel == ACCEL_OCTREE)
+    {
+        name = "octree";
+        octree.build(this, pool);
+    }
+    auto buildEnd = std::chrono::steady_clock::now();
+    if (Stats::enabled && _accel != ACCEL_BRUTE)
+        cout << filename << " " << name << " build: "
+             << std::chrono::duration<double, std::milli>(buildEnd - buildStart).count()
+             << " ms" << endl;
+    buildTimer.stop();
+    Stats::Timer saveTimer(Stats::MESH_LOAD);
+    cache.save(*this);
+}
 
-    // FINAL PROJECT
+// FINAL PROJECT
+void Mesh::computeBox()
+{
     // Calculate bounding box of triangles
     // Get the global extrema.
     Vector3f minBounds(INFINITY, INFINITY, INFINITY);
     Vector3f maxBounds(-INFINITY, -INFINITY, -INFINITY);
-    std::vector<Triangle *> triangles;
-    for (Triangle &t : _triangles)
+    for (uint32_t i : _indices)
     {
-        triangles.push_back(&t);
+        const Vector3f &v = _vertices[i];
         // Slide 43 of L12 - Accelerating Raytracing.
-        minBounds.x() = min(minBounds.x(), (t.box).min.x());
-        minBounds.y() = min(minBounds.y(), (t.box).min.y());
-        minBounds.z() = min(minBounds.z(), (t.box).min.z());
-        maxBounds.x() = max(maxBounds.x(), (t.box).max.x());
-        maxBounds.y() = max(maxBounds.y(), (t.box).max.y());
-        maxBounds.z() = max(maxBounds.z(), (t.box).max.z());
+        minBounds.x() = min(minBounds.x(), v.x());
+        minBounds.y() = min(minBounds.y(), v.y());
+        minBounds.z() = min(minBounds.z(), v.z());
+        maxBounds.x() = max(maxBounds.x(), v.x());
+        maxBounds.y() = max(maxBounds.y(), v.y());
+        maxBounds.z() = max(maxBounds.z(), v.z());
     }
     box = BoundingBox(minBounds, maxBounds);
-    this->triangles = triangles;
+}
 
-    // Start on x axis.
-    int splitDimension = 0;
-    this->rootKD = this->rootKD->buildTree(triangles,
-                               box,
-                               splitDimension
-                               );
-    checkTrianglesInKDTree();
+BoundingBox Mesh::trigBox(int idx) const
+{
+    const Vector3f &a = getVertex(idx, 0);
+    const Vector3f &b = getVertex(idx, 1);
+    const Vector3f &c = getVertex(idx, 2);
+    return BoundingBox(Vector3f(min(a.x(), min(b.x(), c.x())),
+                                min(a.y(), min(b.y(), c.y())),
+                                min(a.z(), min(b.z(), c.z()))),
+                       Vector3f(max(a.x(), max(b.x(), c.x())),
+                                max(a.y(), max(b.y(), c.y())),
+                                max(a.z(), max(b.z(), c.z()))));
+}
 
-    octree.build(this);
+std::vector<BoundingBox> Mesh::trigBoxes() const
+{
+    std::vector<BoundingBox> boxes;
+    boxes.reserve(numTriangles());
+    for (int i = 0; i < numTriangles(); i++)
+        boxes.push_back(trigBox(i));
+    return boxes;
 }
 
-bool checkTriangle(Triangle *t, KDTree *node)
+bool Mesh::parseAccel(const std::string &name, MeshAccel &accel)
+{
+    if (name == "brute")
+        accel = ACCEL_BRUTE;
+    else if (name == "octree")
+        accel = ACCEL_OCTREE;
+    else if (name == "kdtree")
+        accel = ACCEL_KDTREE;
+    else if (name == "bvh")
+        accel = ACCEL_BVH;
+    else
+        return false;
+    return true;
+}
+
+bool checkTriangle(uint32_t t, const BoundingBox &box, const KDTree *node)
 {
     if (node->isLeaf)
     {
-        for (Triangle *tNode : node->triangles)
+        for (uint32_t tNode : node->triangles)
         {
             if (tNode == t)
                 return true;
@@ -170,24 +189,24 @@ bool checkTriangle(Triangle *t, KDTree *node)
     }
     bool A = false;
     bool B = false;
-    if (t->box.min[node->splitDimension] <= node->splitPosition)
+    if (box.min[node->splitDimension] <= node->splitPosition)
     {
-        A = checkTriangle(t, node->left);
+        A = checkTriangle(t, box, node->left);
     }
-    if (t->box.max[node->splitDimension] >= node->splitPosition)
+    if (box.max[node->splitDimension] >= node->splitPosition)
     {
-        B = checkTriangle(t, node->right);
+        B = checkTriangle(t, box, node->right);
     }
     return A or B;
 }
 
-bool Mesh::checkTrianglesInKDTree()
+bool Mesh::checkTrianglesInKDTree(const KDTree *root, const std::vector<BoundingBox> &boxes)
 {
     // Verifies that all triangles in this mesh
     // are actually in the constructed KD tree.
-    for (Triangle *t : triangles)
+    for (uint32_t t = 0; t < boxes.size(); t++)
     {
-        if (!checkTriangle(t, rootKD))
+        if (!checkTriangle(t, boxes[t], root))
             throw - 1;
     }
     return true;
@@ -195,30 +214,132 @@ bool Mesh::checkTrianglesInKDTree()
 
 bool Mesh::intersect(const Ray &r, float tmin, Hit &h) const
 {
-#if 1
-    ray = &r;
-    hit = &h;
-    tm = tmin;
-    return octree.intersect(r);
-#else
-
     // FINAL PROJECT: Smarter traversal
-    return rootKD->traverse(r, tmin, h);
-
-    // Naive traversal across all triangles
-    // bool result = false;
-    // for (Triangle t : _triangles) {
-    //     if (t.intersect(r, tmin, h)) {
-    //         result = true;
-    //     }
-    // }
-    // return result;
-#endif
+    bool result = false;
+    switch (_accel)
+    {
+    case ACCEL_OCTREE:
+        result = octree.intersect(r, tmin, h);
+        break;
+    case ACCEL_KDTREE:
+        result = flatKD.intersect(r, tmin, h, *this);
+        break;
+    case ACCEL_BVH:
+        result = bvh.intersect(r, tmin, h, [&](uint32_t i) {
+            return intersectTrig(i, r, tmin, h);
+        });
+        break;
+    default:
+        // Naive traversal across all triangles
+        for (int i = 0; i < numTriangles(); i++)
+        {
+            if (intersectTrig(i, r, tmin, h))
+            {
+                result = true;
+            }
+        }
+        break;
+    }
+    // The triangles only recorded where they were hit; interpolate the
+    // normal of the closest one.
+    if (result)
+        setTrigHit(h.triangle, h, h.t, h.barycentric[0], h.barycentric[1]);
+    return result;
 }
 
-bool Mesh::intersectTrig(int idx, const Ray &r) const
+// FINAL PROJECT
+bool Mesh::occluded(const Ray &r, float tmin, float tmax) const
 {
-    const Triangle &triangle = _triangles[idx];
-    bool result = triangle.intersect(r, tm, *hit);
-    return result;
+    switch (_accel)
+    {
+    case ACCEL_OCTREE:
+        return octree.occluded(r, tmin, tmax);
+    case ACCEL_KDTREE:
+        return flatKD.occluded(r, tmin, tmax, *this);
+    case ACCEL_BVH:
+        return bvh.occluded(r, tmin, tmax, [&](uint32_t i) {
+            return occludedTrig(i, r, tmin, tmax);
+        });
+    default:
+        for (int i = 0; i < numTriangles(); i++)
+        {
+            if (occludedTrig(i, r, tmin, tmax))
+                return true;
+        }
+        return false;
+    }
+}
+
+int Mesh::intersectPacket(const RayPacket &packet, float tmin, Hit *hits) const
+{
+    // Only the KD tree has packet kernels.
+    if (_accel != ACCEL_KDTREE)
+        return Object3D::intersectPacket(packet, tmin, hits);
+    return flatKD.intersectPacket(packet, tmin, hits, *this);
+}
+
+// FINAL PROJECT
+// Same tests as Triangle::intersect and Triangle::occluded; the edges are
+// computed per test instead of stored, with the same float operations.
+bool Mesh::intersectTrig(int idx, const Ray &r, float tmin, Hit &h) const
+{
+    const Vector3f &v0 = getVertex(idx, 0);
+    float t, beta, gamma;
+    if (!Triangle::mollerTrumbore(v0, getVertex(idx, 1) - v0, getVertex(idx, 2) - v0,
+                                  r, t, beta, gamma))
+        return false;
+    if (t > h.getT() || t < tmin)
+        return false;
+    h.setTriangle(t, idx, beta, gamma);
+    return true;
+}
+
+bool Mesh::occludedTrig(int idx, const Ray &r, float tmin, float tmax) const
+{
+    const Vector3f &v0 = getVertex(idx, 0);
+    float t, beta, gamma;
+    return Triangle::mollerTrumbore(v0, getVertex(idx, 1) - v0, getVertex(idx, 2) - v0,
+                                    r, t, beta, gamma) &&
+           t >= tmin && t < tmax;
+}
+
+void Mesh::setTrigHit(int idx, Hit &h, float t, float beta, float gamma) const
+{
+    const uint32_t *corner = &_indices[3 * idx];
+    float alpha = 1 - beta - gamma;
+    h.set(t, getMaterial(), (alpha * _normals[corner[0]] + beta * _normals[corner[1]] +
+                             gamma * _normals[corner[2]]).normalized());
+    h.triangle = idx;
+}
+
+MeshInstance::MeshInstance(const Mesh *mesh, Material *m) :
+    Object3D(m),
+    _mesh(mesh)
+{
+    box = mesh->box;
+    isBounded = mesh->isBounded;
+}
+
+bool MeshInstance::intersect(const Ray &r, float tmin, Hit &h) const
+{
+    if (!_mesh->intersect(r, tmin, h))
+        return false;
+    h.material = getMaterial();
+    return true;
+}
+
+int MeshInstance::intersectPacket(const RayPacket &packet, float tmin, Hit *hits) const
+{
+    int mask = _mesh->intersectPacket(packet, tmin, hits);
+    for (int i = 0; i < packet.size; i++)
+    {
+        if (mask & (1 << i))
+            hits[i].material = getMaterial();
+    }
+    return mask;
+}
+
+bool MeshInstance::occluded(const Ray &r, float tmin, float tmax) const
+{
+    return _mesh->occluded(r, tmin, tmax);
 }
@@ -3,6 +3,7 @@
 
 #include "Object3D.h"
 #include "ObjTriangle.h"
+#include "BVH.h"
 #include "KDTree.h"
 #include "Octree.h"
 #include "Vector2f.h"
@@ -10,32 +11,97 @@
 
 #include <vector>
 
+class ThreadPool;
+
+// FINAL PROJECT
+// Acceleration structure a Mesh builds and intersects through.
+enum MeshAccel
+{
+  ACCEL_BRUTE,  // test every triangle
+  ACCEL_OCTREE,
+  ACCEL_KDTREE,
+  ACCEL_BVH
+};
+
 class Mesh : public Object3D
 {
 public:
-  Mesh(const std::string &filename, Material *m);
+  // Large OBJ files are parsed on pool, if given.
+  Mesh(const std::string &filename, Material *m, MeshAccel accel = ACCEL_KDTREE,
+       ThreadPool *pool = NULL);
+
+  // Parses "brute", "octree", "kdtree" or "bvh"; false for anything else.
+  static bool parseAccel(const std::string &name, MeshAccel &accel);
 
   virtual bool intersect(const Ray &r, float tmin, Hit &h) const;
 
-  virtual bool intersectTrig(int idx, const Ray &r) const;
+  virtual int intersectPacket(const RayPacket &packet, float tmin, Hit *hits) const;
+
+  virtual bool occluded(const Ray &r, float tmin, float tmax) const;
+
+  // FINAL PROJECT
+  // Triangle idx is stored as three indices into shared vertex and normal
+  // arrays instead of as a Triangle object, which is an order of magnitude
+  // smaller. intersectTrig only records t, idx and the barycentrics in h
+  // (Hit::setTriangle); intersect then interpolates the normal once, for
+  // the closest triangle, with setTrigHit.
+  virtual bool intersectTrig(int idx, const Ray &r, float tmin, Hit &h) const;
 
-  const std::vector<Triangle> &getTriangles() const
+  bool occludedTrig(int idx, const Ray &r, float tmin, float tmax) const;
+
+  // Records a hit on triangle idx at t with barycentric weights beta,
+  // gamma for its corners 1 and 2, including its material and normal.
+  void setTrigHit(int idx, Hit &h, float t, float beta, float gamma) const;
+
+  int numTriangles() const
+  {
+    return (int)(_indices.size() / 3);
+  }
+
+  const Vector3f &getVertex(int idx, int corner) const
   {
-    return _triangles;
+    return _vertices[_indices[3 * idx + corner]];
   }
 
-  bool checkTrianglesInKDTree();
+  BoundingBox trigBox(int idx) const;
+
+  // trigBox of every triangle, in order.
+  std::vector<BoundingBox> trigBoxes() const;
+
+  bool checkTrianglesInKDTree(const KDTree *root, const std::vector<BoundingBox> &boxes);
+
+  FlatKDTree flatKD;
+  BVH bvh;
+
+private:
+  friend class MeshCache;
+
+  // Computes the bounding box from the triangles.
+  void computeBox();
+
+  MeshAccel _accel;
+  std::vector<Vector3f> _vertices;
+  std::vector<Vector3f> _normals;   // one per vertex
+  std::vector<uint32_t> _indices;   // three per triangle
+  Octree octree;
+};
+
+// FINAL PROJECT
+// A shared Mesh drawn with another material than the one it was loaded
+// with. Hits come from the mesh; only their material is replaced.
+class MeshInstance : public Object3D
+{
+public:
+  MeshInstance(const Mesh *mesh, Material *m);
+
+  virtual bool intersect(const Ray &r, float tmin, Hit &h) const;
+
+  virtual int intersectPacket(const RayPacket &packet, float tmin, Hit *hits) const;
 
-  BoundingBox box;
-  KDTree *rootKD = new KDTree();
+  virtual bool occluded(const Ray &r, float tmin, float tmax) const;
 
 private:
-  std::vector<Triangle> _triangles;
-  std::vector<Triangle *> triangles;
-  mutable Octree octree;
-  mutable const Ray *ray;
-  mutable Hit *hit;
-  mutable float tm;
+  const Mesh *_mesh;
 };
 
 #endif
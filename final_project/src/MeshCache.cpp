@@ -0,0 +1,314 @@
+#include "MeshCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MESH_CACHE 1
+#endif
+
+std::string MeshCache::directory;
+
+// Bump whenever the layout of the file, KDNode or BVHNode changes.
+static const uint32_t CACHE_VERSION = 4;
+static const char CACHE_MAGIC[8] = { 'A', '4', 'M', 'E', 'S', 'H', '\0', '\1' };
+
+static_assert(sizeof(Vector3f) == 3 * sizeof(float),
+              "vertex arrays are written as packed floats");
+
+// Everything that has to match for an entry to be used, followed by the
+// array sizes. Zeroed before it is filled in, so that two headers can be
+// compared with memcmp, padding included.
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t accel;
+    int64_t objTime;
+    int64_t objTimeNsec;
+    uint64_t objSize;
+    float kdTraversalCost;
+    float kdIntersectionCost;
+    float kdEmptyBonus;
+    int32_t kdMaxLeafSize;
+    int32_t kdMaxBadRefines;
+    float bvhTraversalCost;
+    float bvhIntersectionCost;
+    int32_t bvhNumBins;
+    int32_t bvhMaxLeafSize;
+    uint32_t pathLength;
+    uint64_t numVertices;
+    uint64_t numTriangles;
+    uint64_t numNodes;
+    uint64_t numIndices;
+    float box[6];
+};
+
+static size_t
+align64(size_t offset) {
+    return (offset + 63) & ~(size_t)63;
+}
+
+// Where each array starts in the file, and where the file ends.
+struct CacheLayout {
+    CacheLayout(const CacheHeader &h) {
+        size_t nodeSize = h.accel == ACCEL_KDTREE ? sizeof(KDNode) :
+                          h.accel == ACCEL_BVH ? sizeof(BVHNode) : 0;
+        path = align64(sizeof(CacheHeader));
+        vertices = align64(path + h.pathLength);
+        normals = align64(vertices + h.numVertices * sizeof(Vector3f));
+        triangles = align64(normals + h.numVertices * sizeof(Vector3f));
+        nodes = align64(triangles + h.numTriangles * 3 * sizeof(uint32_t));
+        indices = align64(nodes + h.numNodes * nodeSize);
+        end = indices + h.numIndices * sizeof(uint32_t);
+    }
+
+    size_t path, vertices, normals, triangles, nodes, indices, end;
+};
+
+// Whether every index in a cache file points into the array it refers to
+// and every child comes after its parent, so that a corrupt file cannot
+// make traversal read out of bounds or loop.
+static bool
+validIndices(const CacheHeader &h, const char *data, const CacheLayout &l) {
+    const uint32_t *triangles = (const uint32_t *)(data + l.triangles);
+    for (uint64_t i = 0; i < 3 * h.numTriangles; ++i) {
+        if (triangles[i] >= h.numVertices) {
+            return false;
+        }
+    }
+    const uint32_t *indices = (const uint32_t *)(data + l.indices);
+    for (uint64_t i = 0; i < h.numIndices; ++i) {
+        if (indices[i] >= h.numTriangles) {
+            return false;
+        }
+    }
+    for (uint64_t i = 0; i < h.numNodes; ++i) {
+        if (h.accel == ACCEL_KDTREE) {
+            const KDNode &node = ((const KDNode *)(data + l.nodes))[i];
+            if (node.isLeaf() ? (uint64_t)node.offset + node.count() > h.numIndices
+                              : node.child() <= i || node.child() + 1 >= h.numNodes) {
+                return false;
+            }
+        } else if (h.accel == ACCEL_BVH) {
+            const BVHNode &node = ((const BVHNode *)(data + l.nodes))[i];
+            if (node.count ? (uint64_t)node.offset + node.count > h.numIndices
+                           : i + 1 >= h.numNodes || node.offset <= i + 1 ||
+                             node.offset >= h.numNodes) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static const char *accelNames[] = { "brute", "octree", "kdtree", "bvh" };
+
+// FNV-1a, to tell apart OBJ files with the same name in different places.
+static uint64_t
+hashPath(const std::string &path) {
+    uint64_t h = 14695981039346656037ull;
+    for (char c : path) {
+        h = (h ^ (unsigned char)c) * 1099511628211ull;
+    }
+    return h;
+}
+
+MeshCache::MeshCache(const std::string &objFile, MeshAccel accel) :
+    _enabled(false),
+    _accel(accel),
+    _objTime(0),
+    _objTimeNsec(0),
+    _objSize(0) {
+#ifdef HAVE_MESH_CACHE
+    if (directory.empty()) {
+        return;
+    }
+    char resolved[PATH_MAX];
+    struct stat st;
+    if (!realpath(objFile.c_str(), resolved) || stat(resolved, &st) != 0) {
+        return;
+    }
+    _objPath = resolved;
+    // Seconds alone would miss a file rewritten within the same second.
+    _objTime = (int64_t)st.st_mtime;
+#ifdef __APPLE__
+    _objTimeNsec = (int64_t)st.st_mtimespec.tv_nsec;
+#else
+    _objTimeNsec = (int64_t)st.st_mtim.tv_nsec;
+#endif
+    _objSize = (uint64_t)st.st_size;
+
+    size_t slash = _objPath.find_last_of('/');
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)hashPath(_objPath));
+    _cacheFile = directory + "/" + _objPath.substr(slash + 1) + "-" + hash +
+                 "." + accelNames[accel] + ".cache";
+    _enabled = true;
+#endif
+}
+
+void
+MeshCache::fillHeader(CacheHeader &h) const {
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.version = CACHE_VERSION;
+    h.accel = (uint32_t)_accel;
+    h.objTime = _objTime;
+    h.objTimeNsec = _objTimeNsec;
+    h.objSize = _objSize;
+    if (_accel == ACCEL_KDTREE) {
+        h.kdTraversalCost = KDTree::traversalCost;
+        h.kdIntersectionCost = KDTree::intersectionCost;
+        h.kdEmptyBonus = KDTree::emptyBonus;
+        h.kdMaxLeafSize = KDTree::maxLeafSize;
+        h.kdMaxBadRefines = KDTree::maxBadRefines;
+    } else if (_accel == ACCEL_BVH) {
+        h.bvhTraversalCost = BVH::traversalCost;
+        h.bvhIntersectionCost = BVH::intersectionCost;
+        h.bvhNumBins = BVH::numBins;
+        h.bvhMaxLeafSize = BVH::maxLeafSize;
+    }
+    h.pathLength = (uint32_t)_objPath.size();
+}
+
+bool
+MeshCache::load(Mesh &mesh) const {
+#ifdef HAVE_MESH_CACHE
+    if (!_enabled) {
+        return false;
+    }
+    int fd = open(_cacheFile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    const char *data = (const char *)map;
+
+    // The file's header must equal ours apart from the array sizes.
+    CacheHeader stored, expected;
+    memcpy(&stored, data, sizeof(stored));
+    fillHeader(expected);
+    expected.numVertices = stored.numVertices;
+    expected.numTriangles = stored.numTriangles;
+    expected.numNodes = stored.numNodes;
+    expected.numIndices = stored.numIndices;
+    memcpy(expected.box, stored.box, sizeof(expected.box));
+    CacheLayout l(stored);
+    bool valid = !memcmp(&stored, &expected, sizeof(stored)) && l.end <= size &&
+                 !memcmp(data + l.path, _objPath.data(), _objPath.size()) &&
+                 validIndices(stored, data, l);
+    if (valid) {
+        const Vector3f *vertices = (const Vector3f *)(data + l.vertices);
+        const Vector3f *normals = (const Vector3f *)(data + l.normals);
+        const uint32_t *triangles = (const uint32_t *)(data + l.triangles);
+        mesh._vertices.assign(vertices, vertices + stored.numVertices);
+        mesh._normals.assign(normals, normals + stored.numVertices);
+        mesh._indices.assign(triangles, triangles + 3 * stored.numTriangles);
+        mesh.computeBox();
+
+        const uint32_t *indices = (const uint32_t *)(data + l.indices);
+        if (_accel == ACCEL_KDTREE) {
+            const KDNode *nodes = (const KDNode *)(data + l.nodes);
+            FlatKDTree &kd = mesh.flatKD;
+            kd.nodes.assign(nodes, nodes + stored.numNodes);
+            kd.indices.assign(indices, indices + stored.numIndices);
+            kd.box = BoundingBox(Vector3f(stored.box[0], stored.box[1], stored.box[2]),
+                                 Vector3f(stored.box[3], stored.box[4], stored.box[5]));
+            kd.buildPacketTriangles(mesh);
+        } else if (_accel == ACCEL_BVH) {
+            const BVHNode *nodes = (const BVHNode *)(data + l.nodes);
+            mesh.bvh.nodes.assign(nodes, nodes + stored.numNodes);
+            mesh.bvh.indices.assign(indices, indices + stored.numIndices);
+        }
+    }
+    munmap(map, size);
+    return valid;
+#else
+    (void)mesh;
+    return false;
+#endif
+}
+
+void
+MeshCache::save(const Mesh &mesh) const {
+#ifdef HAVE_MESH_CACHE
+    if (!_enabled) {
+        return;
+    }
+    mkdir(directory.c_str(), 0755);
+
+    CacheHeader h;
+    fillHeader(h);
+    h.numVertices = mesh._vertices.size();
+    h.numTriangles = mesh.numTriangles();
+    const void *nodes = NULL;
+    const std::vector<uint32_t> *indices = NULL;
+    if (_accel == ACCEL_KDTREE) {
+        h.numNodes = mesh.flatKD.nodes.size();
+        nodes = mesh.flatKD.nodes.data();
+        indices = &mesh.flatKD.indices;
+        for (int a = 0; a < 3; ++a) {
+            h.box[a] = mesh.flatKD.box.min[a];
+            h.box[3 + a] = mesh.flatKD.box.max[a];
+        }
+    } else if (_accel == ACCEL_BVH) {
+        h.numNodes = mesh.bvh.nodes.size();
+        nodes = mesh.bvh.nodes.data();
+        indices = &mesh.bvh.indices;
+    }
+    h.numIndices = indices ? indices->size() : 0;
+    CacheLayout l(h);
+
+    std::vector<char> data(l.end, 0);
+    memcpy(&data[0], &h, sizeof(h));
+    memcpy(&data[l.path], _objPath.data(), _objPath.size());
+    if (h.numVertices) {
+        memcpy(&data[l.vertices], mesh._vertices.data(), h.numVertices * sizeof(Vector3f));
+        memcpy(&data[l.normals], mesh._normals.data(), h.numVertices * sizeof(Vector3f));
+    }
+    if (h.numTriangles) {
+        memcpy(&data[l.triangles], mesh._indices.data(), h.numTriangles * 3 * sizeof(uint32_t));
+    }
+    if (h.numNodes) {
+        size_t nodeSize = _accel == ACCEL_KDTREE ? sizeof(KDNode) : sizeof(BVHNode);
+        memcpy(&data[l.nodes], nodes, h.numNodes * nodeSize);
+    }
+    if (h.numIndices) {
+        memcpy(&data[l.indices], indices->data(), h.numIndices * sizeof(uint32_t));
+    }
+
+    // Write under a temporary name and rename, so that a run reading the
+    // cache at the same time never sees half a file.
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+    std::string tmp = _cacheFile + suffix;
+    FILE *f = fopen(tmp.c_str(), "wb");
+    bool written = f && fwrite(&data[0], 1, data.size(), f) == data.size();
+    if (f) {
+        written = fclose(f) == 0 && written;
+    }
+    if (!written || rename(tmp.c_str(), _cacheFile.c_str()) != 0) {
+        std::cout << "Cannot write mesh cache " << _cacheFile << std::endl;
+        remove(tmp.c_str());
+    }
+#else
+    (void)mesh;
+#endif
+}
@@ -0,0 +1,50 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <stdint.h>
+#include <string>
+
+#include "Mesh.h"
+
+struct CacheHeader;
+
+// FINAL PROJECT
+// On-disk cache of what Mesh::Mesh computes from an OBJ file: the
+// vertices, vertex normals and triangle indices and, for the KD tree and
+// the BVH, the flat node and index arrays. An entry is only used if it was written for the same OBJ path,
+// modification time (to the nanosecond, where the file system has it) and
+// size, the same acceleration structure and the same build parameters,
+// and if all of its indices are in range; otherwise the mesh is parsed and
+// built as usual and the entry is rewritten.
+//
+// A cache file is a fixed header followed by the arrays, each starting on
+// a 64-byte boundary, in native byte order. Loading maps the file and
+// copies each array out with one memcpy.
+class MeshCache
+{
+public:
+    // Directory for the cache files; empty (the default) turns caching off.
+    static std::string directory;
+
+    MeshCache(const std::string &objFile, MeshAccel accel);
+
+    // Fills in mesh's geometry, bounding box and flat acceleration
+    // structure from the cache. False if there is no valid entry.
+    bool load(Mesh &mesh) const;
+
+    // Writes mesh's geometry and flat acceleration structure.
+    void save(const Mesh &mesh) const;
+
+private:
+    void fillHeader(CacheHeader &header) const;
+
+    bool _enabled;
+    MeshAccel _accel;
+    std::string _objPath;   // absolute
+    std::string _cacheFile;
+    int64_t _objTime;
+    int64_t _objTimeNsec;
+    uint64_t _objSize;
+};
+
+#endif // MESH_CACHE_H
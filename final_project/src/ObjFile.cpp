@@ -0,0 +1,292 @@
+#include "ObjFile.h"
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdint.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#endif
+
+// Files are split into chunks of at least this many bytes for the pool.
+static const size_t MIN_CHUNK_BYTES = 1 << 20;
+
+static const double POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool
+isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool
+isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline void
+skipBlanks(const char *&p, const char *end) {
+    while (p < end && isBlank(*p)) {
+        ++p;
+    }
+}
+
+// strtof on a copy of the token at p, for the numbers parseFloat leaves
+// to the C library.
+static bool
+parseFloatSlow(const char *&p, const char *end, float &value) {
+    char buffer[64];
+    size_t n = 0;
+    while (p + n < end && n < sizeof(buffer) - 1 && !isBlank(p[n]) && p[n] != '/') {
+        buffer[n] = p[n];
+        ++n;
+    }
+    buffer[n] = '\0';
+    char *stop;
+    value = strtof(buffer, &stop);
+    p += stop - buffer;
+    return stop != buffer;
+}
+
+// Reads a float at p (after any blanks) and moves p past it. Decimal
+// numbers with at most 19 significant digits and a small exponent are
+// converted exactly with one double multiply or divide (both operands are
+// exact, so the double is correctly rounded), then narrowed to float; the
+// narrowing can only round wrongly when the double falls exactly halfway
+// between two floats, so those, and everything else, go to strtof.
+static bool
+parseFloat(const char *&p, const char *end, float &value) {
+    skipBlanks(p, end);
+    const char *start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+    uint64_t mantissa = 0;
+    int significant = 0;
+    int exponent = 0;
+    bool digits = false;
+    bool exact = true;
+    for (; p < end && isDigit(*p); ++p) {
+        digits = true;
+        if (significant < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            significant += mantissa != 0;
+        } else {
+            exact = false;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && isDigit(*p); ++p) {
+            digits = true;
+            if (significant < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant += mantissa != 0;
+                --exponent;
+            } else {
+                exact = false;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *e = p + 1;
+        bool negativeExponent = false;
+        if (e < end && (*e == '-' || *e == '+')) {
+            negativeExponent = *e == '-';
+            ++e;
+        }
+        if (e == end || !isDigit(*e)) {
+            exact = false;
+        }
+        int written = 0;
+        for (; e < end && isDigit(*e); ++e) {
+            written = std::min(written * 10 + (*e - '0'), 1000);
+        }
+        exponent += negativeExponent ? -written : written;
+        p = e;
+    }
+    if (!digits || !exact || mantissa > (1ull << 53) || exponent < -22 || exponent > 22) {
+        p = start;
+        return parseFloatSlow(p, end, value);
+    }
+    if (mantissa == 0) {
+        value = negative ? -0.0f : 0.0f;
+        return true;
+    }
+    double d = exponent < 0 ? mantissa / POWERS_OF_TEN[-exponent]
+                            : mantissa * POWERS_OF_TEN[exponent];
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    // The 29 mantissa bits a float drops: 1 followed by zeros is a tie.
+    const uint64_t dropped = (1ull << 29) - 1;
+    if (d > FLT_MAX || d < FLT_MIN || (bits & dropped) == (1ull << 28)) {
+        p = start;
+        return parseFloatSlow(p, end, value);
+    }
+    value = (float)(negative ? -d : d);
+    return true;
+}
+
+static bool
+parseInt(const char *&p, const char *end, int &value) {
+    skipBlanks(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+    if (p == end || !isDigit(*p)) {
+        return false;
+    }
+    int v = 0;
+    for (; p < end && isDigit(*p); ++p) {
+        v = v * 10 + (*p - '0');
+    }
+    value = negative ? -v : v;
+    return true;
+}
+
+void
+ObjFile::parse(const char *begin, const char *end) {
+    const char *line = begin;
+    while (line < end) {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (!eol) {
+            eol = end;
+        }
+        const char *p = line;
+        line = eol + 1;
+        if (eol - p < 3 || *p == '#') {
+            continue;
+        }
+        skipBlanks(p, eol);
+        const char *tok = p;
+        while (p < eol && !isBlank(*p)) {
+            ++p;
+        }
+        size_t length = p - tok;
+        if (length == 1 && tok[0] == 'v') {
+            Vector3f v;
+            for (int i = 0; i < 3 && parseFloat(p, eol, v[i]); ++i) {
+            }
+            vertices.push_back(v);
+        } else if (length == 2 && tok[0] == 'v' && tok[1] == 't') {
+            Vector2f t;
+            for (int i = 0; i < 2 && parseFloat(p, eol, t[i]); ++i) {
+            }
+            texCoords.push_back(t);
+        } else if (length == 1 && tok[0] == 'f') {
+            // Corners are v, v/vt, v/vt/vn or v//vn; faces with more than
+            // three corners keep the first three.
+            ObjTriangle trig;
+            int corners = 0;
+            for (; corners < 3 && parseInt(p, eol, trig[corners]); ++corners) {
+                trig[corners]--;
+                int index;
+                if (p < eol && *p == '/') {
+                    ++p;
+                    if (parseInt(p, eol, index)) {
+                        trig.texID[corners] = index - 1;
+                    }
+                    if (p < eol && *p == '/') {
+                        ++p;
+                        parseInt(p, eol, index);
+                    }
+                }
+            }
+            if (corners == 3) {
+                triangles.push_back(trig);
+            }
+        }
+    }
+}
+
+bool
+ObjFile::read(const std::string &filename, ThreadPool *pool) {
+    vertices.clear();
+    texCoords.clear();
+    triangles.clear();
+
+#ifdef HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    if (map) {
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+    const char *data = (const char *)map;
+#else
+    std::ifstream f(filename.c_str(), std::ios::binary);
+    if (!f) {
+        return false;
+    }
+    std::vector<char> contents((std::istreambuf_iterator<char>(f)),
+                               std::istreambuf_iterator<char>());
+    size_t size = contents.size();
+    const char *data = size ? &contents[0] : NULL;
+#endif
+    const char *end = data + size;
+
+    int chunks = pool ? (int)std::min<size_t>(pool->size() * 4, size / MIN_CHUNK_BYTES) : 1;
+    if (chunks <= 1) {
+        parse(data, end);
+    } else {
+        // Cut at the first line break after each even split.
+        std::vector<const char *> bounds(chunks + 1, end);
+        bounds[0] = data;
+        for (int i = 1; i < chunks; ++i) {
+            const char *cut = std::max(data + size / chunks * i, bounds[i - 1]);
+            const char *eol = (const char *)memchr(cut, '\n', end - cut);
+            bounds[i] = eol ? eol + 1 : end;
+        }
+        std::vector<ObjFile> parts(chunks);
+        pool->parallelFor(chunks, [&](int i) {
+            parts[i].parse(bounds[i], bounds[i + 1]);
+        });
+        size_t numVertices = 0, numTexCoords = 0, numTriangles = 0;
+        for (const ObjFile &part : parts) {
+            numVertices += part.vertices.size();
+            numTexCoords += part.texCoords.size();
+            numTriangles += part.triangles.size();
+        }
+        vertices.reserve(numVertices);
+        texCoords.reserve(numTexCoords);
+        triangles.reserve(numTriangles);
+        for (const ObjFile &part : parts) {
+            vertices.insert(vertices.end(), part.vertices.begin(), part.vertices.end());
+            texCoords.insert(texCoords.end(), part.texCoords.begin(), part.texCoords.end());
+            triangles.insert(triangles.end(), part.triangles.begin(), part.triangles.end());
+        }
+    }
+
+#ifdef HAVE_MMAP
+    if (map) {
+        munmap(map, size);
+    }
+#endif
+    return true;
+}
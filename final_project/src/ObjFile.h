@@ -0,0 +1,36 @@
+#ifndef OBJ_FILE_H
+#define OBJ_FILE_H
+
+#include <string>
+#include <vector>
+
+#include "ObjTriangle.h"
+#include "vecmath.h"
+
+class ThreadPool;
+
+// FINAL PROJECT
+// The parts of a Wavefront OBJ file that Mesh uses: vertex positions
+// ("v"), texture coordinates ("vt") and the first three corners of every
+// face ("f"), with or without slashes. Other lines are skipped.
+//
+// The file is mapped into memory and tokenized in place, without copying
+// it into lines or streams. Numbers are parsed by hand and give the same
+// floats as strtof (and so as reading them with >>). Large files are split
+// at line breaks and parsed on a thread pool, if one is given.
+class ObjFile
+{
+public:
+    // False if the file cannot be opened.
+    bool read(const std::string &filename, ThreadPool *pool = NULL);
+
+    // Parses the text in [begin, end) and appends what it finds.
+    void parse(const char *begin, const char *end);
+
+    std::vector<Vector3f> vertices;
+    std::vector<Vector2f> texCoords;
+    // Zero-based vertex and texture coordinate indices.
+    std::vector<ObjTriangle> triangles;
+};
+
+#endif // OBJ_FILE_H
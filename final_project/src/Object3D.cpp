@@ -1,4 +1,5 @@
 #include "Object3D.h"
+#include "BVH.h"
 
 using namespace std;
 
@@ -54,9 +55,93 @@ bool Sphere::intersect(const Ray &r, float tmin, Hit &h) const {
     return false;
 }
 
+bool Sphere::occluded(const Ray &r, float tmin, float tmax) const {
+    // Same roots as intersect; report the nearer one past tmin.
+    Vector3f origin = r.getOrigin() - _center;
+    const Vector3f &dir = r.getDirection();
+    float a = dir.absSquared();
+    float b = 2 * Vector3f::dot(dir, origin);
+    float c = origin.absSquared() - _radius * _radius;
+    if (b * b - 4 * a * c < 0) {
+        return false;
+    }
+    float d = sqrt(b * b - 4 * a * c);
+    float tplus = (-b + d) / (2.0f * a);
+    float tminus = (-b - d) / (2.0f * a);
+    if (tminus > tmin) {
+        return tminus < tmax;
+    }
+    return tplus > tmin && tplus < tmax;
+}
+
+int Object3D::intersectPacket(const RayPacket &packet, float tmin, Hit *hits) const {
+    int mask = 0;
+    for (int i = 0; i < packet.size; ++i) {
+        if (intersect(packet.rays[i], tmin, hits[i])) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+void Object3D::fixBBox(const Matrix4f &m) {
+    // Transform all 8 corners and take their extent.
+    Vector3f lo(INFINITY), hi(-INFINITY);
+    for (int corner = 0; corner < 8; ++corner) {
+        Vector3f p(box.bounds(corner & 1).x(),
+                   box.bounds((corner >> 1) & 1).y(),
+                   box.bounds((corner >> 2) & 1).z());
+        Vector3f q = (m * Vector4f(p, 1)).xyz();
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = std::min(lo[a], q[a]);
+            hi[a] = std::max(hi[a], q[a]);
+        }
+    }
+    box = BoundingBox(lo, hi);
+}
+
+Group::~Group() {
+    delete m_bvh;
+}
+
 // Add object to group
 void Group::addObject(Object3D *obj) {
     m_members.push_back(obj);
+    delete m_bvh;
+    m_bvh = NULL;
+}
+
+void Group::build(ThreadPool *pool) {
+    Stats::Timer timer(Stats::ACCEL_BUILD);
+    m_bounded.clear();
+    m_unbounded.clear();
+    std::vector<BoundingBox> boxes;
+    Vector3f lo(INFINITY), hi(-INFINITY);
+    for (Object3D *o : m_members) {
+        // Empty boxes (e.g. a mesh that failed to load) have no centroid
+        // to sort by; they are cheap to test directly.
+        bool empty = o->box.min.x() > o->box.max.x();
+        if (!o->isBounded || empty) {
+            m_unbounded.push_back(o);
+            continue;
+        }
+        m_bounded.push_back(o);
+        boxes.push_back(o->box);
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = std::min(lo[a], o->box.min[a]);
+            hi[a] = std::max(hi[a], o->box.max[a]);
+        }
+    }
+    delete m_bvh;
+    m_bvh = new BVH();
+    m_bvh->build(boxes, pool);
+    box = BoundingBox(lo, hi);
+    isBounded = true;
+    for (Object3D *o : m_unbounded) {
+        if (!o->isBounded) {
+            isBounded = false;
+        }
+    }
 }
 
 // Return number of objects in group
@@ -65,16 +150,66 @@ int Group::getGroupSize() const {
 }
 
 bool Group::intersect(const Ray &r, float tmin, Hit &h) const {
-    // BEGIN STARTER
-    // we implemented this for you
-    bool hit = false;
-    for (Object3D *o : m_members) {
-        if (o->intersect(r, tmin, h)) {
-            hit = true;
+    if (!m_bvh) {
+        // BEGIN STARTER
+        // we implemented this for you
+        bool hit = false;
+        for (Object3D *o : m_members) {
+            if (o->intersect(r, tmin, h)) {
+                hit = true;
+            }
         }
+        return hit;
+        // END STARTER
+    }
+
+    // FINAL PROJECT
+    bool hit = false;
+    for (Object3D *o : m_unbounded) {
+        hit |= o->intersect(r, tmin, h);
     }
+    hit |= m_bvh->intersect(r, tmin, h, [&](uint32_t i) {
+        return m_bounded[i]->intersect(r, tmin, h);
+    });
     return hit;
-    // END STARTER
+}
+
+bool Group::occluded(const Ray &r, float tmin, float tmax) const {
+    if (!m_bvh) {
+        for (Object3D *o : m_members) {
+            if (o->occluded(r, tmin, tmax)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    for (Object3D *o : m_unbounded) {
+        if (o->occluded(r, tmin, tmax)) {
+            return true;
+        }
+    }
+    return m_bvh->occluded(r, tmin, tmax, [&](uint32_t i) {
+        return m_bounded[i]->occluded(r, tmin, tmax);
+    });
+}
+
+int Group::intersectPacket(const RayPacket &packet, float tmin, Hit *hits) const {
+    if (!m_bvh) {
+        int mask = 0;
+        for (Object3D *o : m_members) {
+            mask |= o->intersectPacket(packet, tmin, hits);
+        }
+        return mask;
+    }
+
+    int mask = 0;
+    for (Object3D *o : m_unbounded) {
+        mask |= o->intersectPacket(packet, tmin, hits);
+    }
+    mask |= m_bvh->intersectPacket(packet, tmin, hits, [&](uint32_t i) {
+        return m_bounded[i]->intersectPacket(packet, tmin, hits);
+    });
+    return mask;
 }
 
 
@@ -82,6 +217,7 @@ Plane::Plane(const Vector3f &normal, float d, Material *m) : Object3D(m) {
     _d = d;
     _normal = normal;
     _m = m;
+    isBounded = false;
 }
 
 bool Plane::intersect(const Ray &r, float tmin, Hit &h) const {
@@ -92,74 +228,128 @@ bool Plane::intersect(const Ray &r, float tmin, Hit &h) const {
     return true;
 }
 
+bool Plane::occluded(const Ray &r, float tmin, float tmax) const {
+    float t = (_d - Vector3f::dot(_normal, r.getOrigin())) / Vector3f::dot(_normal, r.getDirection().normalized());
+    return t >= tmin && t < tmax;
+}
+
+bool Triangle::mollerTrumbore(const Vector3f &v0, const Vector3f &e1, const Vector3f &e2,
+                              const Ray &r, float &t, float &beta, float &gamma) {
+    // FINAL PROJECT
+    // Moller & Trumbore, "Fast, Minimum Storage Ray/Triangle Intersection".
+    // Solves the system the old Matrix3f::inverse() test solved (see
+    // bench_triangle), with Cramer's rule.
+    Stats::count(Stats::TRIANGLE_TESTS);
+    Vector3f p = Vector3f::cross(r.dir, e2);
+    float det = Vector3f::dot(e1, p);
+    if (det == 0) return false; // ray parallel to the triangle
+    float invDet = 1.0f / det;
+    Vector3f s = r.orig - v0;
+    beta = Vector3f::dot(s, p) * invDet;
+    if (beta < 0 || beta > 1) return false;
+    Vector3f q = Vector3f::cross(s, e1);
+    gamma = Vector3f::dot(r.dir, q) * invDet;
+    if (gamma < 0 || beta + gamma > 1) return false;
+    t = Vector3f::dot(e2, q) * invDet;
+    return true;
+}
+
+void Triangle::setHit(Hit &h, float t, float beta, float gamma) const {
+    float alpha = 1 - beta - gamma;
+    h.set(t, material, (alpha * _normals[0] + beta * _normals[1] + gamma * _normals[2]).normalized());
+}
+
 bool Triangle::intersect(const Ray &r, float tmin, Hit &h, float tstart, float tend) const {
-    // cout << "Triangle::intersect CALLED" << endl;
-    // See L10 - Raycasting II slides, page 16.
-    Matrix3f A(
-        _v[0] - _v[1], _v[0] - _v[2], r.getDirection()
-    );
-    Vector3f B = _v[0] - r.getOrigin();
-    Vector3f X = A.inverse() * B;
-    // cout << "   > calculated X using A.inverse() and B" << endl;
-    // Barycentric ratios
-    float alpha = 1 - X[0] - X[1];
-    float beta = X[0];
-    float gamma = X[1];
-    // cout << "   > calculated barycentric coordinates for triangle-ray intersection" << endl;
-    float t = X[2];
+    float t, beta, gamma;
+    if (!mollerTrumbore(r, t, beta, gamma)) return false;
     // FINAL PROJECT
     /*
     For leaves, do NOT report intersection if t is not in [tnear, tfar].
     – Important for primitives that overlap multiple nodes!
     */
     if (t < tstart or t > tend) return false;
-    // cout << "   > extracted t = X[2]" << endl;
-    if (t > h.getT() || t < tmin || alpha < 0 || beta < 0 || gamma < 0) return false;
-    // cout << "   > attempting to set Hit &h..." << endl;
-    h.set(t, material, (alpha * _normals[0] + beta * _normals[1] + gamma * _normals[2]).normalized());
-    // cout << "   > set Hit &h with the appropriate intersection properties" << endl;
+    if (t > h.getT() || t < tmin) return false;
+    setHit(h, t, beta, gamma);
     return true;
 }
 
 bool Triangle::intersect(const Ray &r, float tmin, Hit &h) const {
-    // cout << "Triangle::intersect CALLED" << endl;
-    // See L10 - Raycasting II slides, page 16.
-    Matrix3f A(
-        _v[0] - _v[1], _v[0] - _v[2], r.getDirection()
-    );
-    Vector3f B = _v[0] - r.getOrigin();
-    Vector3f X = A.inverse() * B;
-    // cout << "   > calculated X using A.inverse() and B" << endl;
-    // Barycentric ratios
-    float alpha = 1 - X[0] - X[1];
-    float beta = X[0];
-    float gamma = X[1];
-    // cout << "   > calculated barycentric coordinates for triangle-ray intersection" << endl;
-    float t = X[2];
-    // cout << "   > extracted t = X[2]" << endl;
-    if (t > h.getT() || t < tmin || alpha < 0 || beta < 0 || gamma < 0) return false;
-    // cout << "   > attempting to set Hit &h..." << endl;
-    h.set(t, material, (alpha * _normals[0] + beta * _normals[1] + gamma * _normals[2]).normalized());
-    // cout << "   > set Hit &h with the appropriate intersection properties" << endl;
+    float t, beta, gamma;
+    if (!mollerTrumbore(r, t, beta, gamma)) return false;
+    if (t > h.getT() || t < tmin) return false;
+    setHit(h, t, beta, gamma);
     return true;
 }
 
+bool Triangle::occluded(const Ray &r, float tmin, float tmax) const {
+    float t, beta, gamma;
+    return mollerTrumbore(r, t, beta, gamma) && t >= tmin && t < tmax;
+}
+
 Transform::Transform(const Matrix4f &m,
                      Object3D *obj) : _object(obj) {
     M = m;
+    // FINAL PROJECT
+    box = obj->box;
+    isBounded = obj->isBounded;
+    if (isBounded) {
+        fixBBox(M);
+    }
+    _worldToLocal = M.inverse();
+    _normalMatrix = _worldToLocal.transposed();
+    _affine = M(3, 0) == 0 && M(3, 1) == 0 && M(3, 2) == 0 && M(3, 3) == 1;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            _localRows[i][j] = _worldToLocal(i, j);
+        }
+        for (int j = 0; j < 3; ++j) {
+            _normalRows[i][j] = _normalMatrix(i, j);
+        }
+    }
+}
+
+// Rows of a 3x3 (or the linear part of a 3x4) matrix times v, summed in
+// the same order as vecmath's Matrix4f * Vector4f.
+template <int N>
+static Vector3f multiply(const float (&m)[3][N], const float *v) {
+    return Vector3f(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                    m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                    m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+}
+
+Ray Transform::toLocal(const Ray &r) const {
+    if (_affine) {
+        const float *o = r.orig;
+        const float *d = r.dir;
+        Vector3f dir = multiply(_localRows, d);
+        Vector3f orig(_localRows[0][0] * o[0] + _localRows[0][1] * o[1] + _localRows[0][2] * o[2] + _localRows[0][3],
+                      _localRows[1][0] * o[0] + _localRows[1][1] * o[1] + _localRows[1][2] * o[2] + _localRows[1][3],
+                      _localRows[2][0] * o[0] + _localRows[2][1] * o[1] + _localRows[2][2] * o[2] + _localRows[2][3]);
+        return Ray(orig, dir);
+    }
+    Vector3f rayOriginLocal = (_worldToLocal * Vector4f(r.getOrigin(), 1)).xyz();
+    Vector3f rayDirectionLocal = (_worldToLocal * Vector4f(r.getDirection(), 0)).xyz();
+    return Ray(rayOriginLocal, rayDirectionLocal);
+}
+
+bool Transform::occluded(const Ray &r, float tmin, float tmax) const {
+    return _object->occluded(toLocal(r), tmin, tmax);
 }
 
 bool Transform::intersect(const Ray &r, float tmin, Hit &h) const {
 
     // Move ray into object coordinate space
-    Matrix4f worldToLocal = M.inverse();
-    Vector3f rayOriginLocal = (worldToLocal * Vector4f(r.getOrigin(), 1)).xyz();
-    Vector3f rayDirectionLocal = (worldToLocal * Vector4f(r.getDirection(), 0)).xyz();
-    Ray rLocal = Ray(rayOriginLocal, rayDirectionLocal);
+    Ray rLocal = toLocal(r);
 
     // Check for intersection.
     if(_object -> intersect(rLocal, tmin, h)) {
-        Vector3f normal = (worldToLocal.transposed() * Vector4f(h.getNormal().normalized(), 0)).xyz().normalized();
+        Vector3f normal;
+        if (_affine) {
+            Vector3f n = h.getNormal().normalized();
+            normal = multiply(_normalRows, n).normalized();
+        } else {
+            normal = (_normalMatrix * Vector4f(h.getNormal().normalized(), 0)).xyz().normalized();
+        }
         h.set(h.getT(), h.getMaterial(), normal);
         return true;
     } else {
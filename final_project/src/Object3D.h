@@ -3,12 +3,17 @@
 
 #include "Ray.h"
 #include "Material.h"
+#include "Packet.h"
+#include "Stats.h"
+#include <vector>
 #include <iostream>
 
 #include <string>
 
 using namespace std;
 
+class ThreadPool;
+
 // FINAL PROJECT
 class BoundingBox
 {
@@ -56,6 +61,12 @@ public:
         return max[axis] - min[axis];
     }
 
+    float surfaceArea() const
+    {
+        float x = d(0), y = d(1), z = d(2);
+        return 2 * (x * y + y * z + z * x);
+    }
+
     float isPlanar()
     {
         return dx() <= 0.01 || dy() <= 0.01 || dz() <= 0.01;
@@ -64,8 +75,12 @@ public:
     // Code taken mostly from
     // https://www.scratchapixel.com/lessons/3d-basic-rendering/
     // minimal-ray-tracer-rendering-simple-shapes/ray-box-intersection.
-    vector<float> intersect(const Ray &r)
+    // Slab test: returns whether the ray's line hits the box and, if so,
+    // the entry and exit parameters. Does not allocate, so it is safe to
+    // call once per ray (or per node) in traversal loops.
+    bool intersect(const Ray &r, float &tnear, float &tfar) const
     {
+        Stats::count(Stats::BOX_TESTS);
         float tmin, tmax, tymin, tymax, tzmin, tzmax;
 
         tmin = (bounds(r.sign[0]).x() - r.orig.x()) * r.invdir.x();
@@ -74,7 +89,7 @@ public:
         tymax = (bounds(1 - r.sign[1]).y() - r.orig.y()) * r.invdir.y();
 
         if ((tmin > tymax) || (tymin > tmax))
-            return vector<float>{};
+            return false;
         if (tymin > tmin)
             tmin = tymin;
         if (tymax < tmax)
@@ -84,15 +99,19 @@ public:
         tzmax = (bounds(1 - r.sign[2]).z() - r.orig.z()) * r.invdir.z();
 
         if ((tmin > tzmax) || (tzmin > tmax))
-            return vector<float>{};
+            return false;
         if (tzmin > tmin)
             tmin = tzmin;
         if (tzmax < tmax)
             tmax = tzmax;
-        return vector<float>{tmin, tmax};
+        tnear = tmin;
+        tfar = tmax;
+        return true;
     }
 };
 
+class BVH;
+
 class Object3D
 {
 public:
@@ -118,13 +137,31 @@ public:
     }
 
     virtual bool intersect(const Ray &r, float tmin, Hit &h) const = 0;
+
+    // FINAL PROJECT
+    // Any-hit query for shadow rays: true if the ray hits something with
+    // t in [tmin, tmax). Stops at the first such hit and computes no
+    // normal or material.
+    virtual bool occluded(const Ray &r, float tmin, float tmax) const = 0;
+
+    // FINAL PROJECT
+    // Intersects every ray of the packet, updating hits[i] for ray i, and
+    // returns a mask with bit i set if ray i hit. The default traces the
+    // rays one at a time; objects with a SIMD path override it.
+    virtual int intersectPacket(const RayPacket &packet, float tmin, Hit *hits) const;
+
+    // FINAL PROJECT
+    // Replaces box with the axis-aligned box around box transformed by m.
     void fixBBox(const Matrix4f &m);
 
     std::string type;
     Material *material;
     bool isTriangle = false;
     bool isMesh = false;
+    // World-space bounds. Only meaningful if isBounded; infinite planes
+    // (and groups or transforms containing one) have no finite box.
     BoundingBox box;
+    bool isBounded = true;
 };
 
 class Sphere : public Object3D
@@ -135,6 +172,7 @@ public:
     {
         _center = Vector3f(0.0, 0.0, 0.0);
         _radius = 1.0f;
+        box = BoundingBox(Vector3f(-1), Vector3f(1));
     }
 
     Sphere(const Vector3f &center,
@@ -143,10 +181,13 @@ public:
                                  _center(center),
                                  _radius(radius)
     {
+        box = BoundingBox(center - Vector3f(radius), center + Vector3f(radius));
     }
 
     virtual bool intersect(const Ray &r, float tmin, Hit &h) const override;
 
+    virtual bool occluded(const Ray &r, float tmin, float tmax) const override;
+
 private:
     Vector3f _center;
     float _radius;
@@ -197,12 +238,26 @@ public:
         centroidX = centroid[0];
         centroidY = centroid[1];
         centroidZ = centroid[2];
+
+        // Edges for the Moller-Trumbore test, computed once here instead
+        // of once per ray.
+        _e1 = b - a;
+        _e2 = c - a;
     }
 
+    // Moller-Trumbore test against the precomputed edges. Finds the same
+    // hits as the old Matrix3f::inverse() test (kept in bench_triangle):
+    // both only reject rays exactly parallel to
+    // the triangle, and t and the barycentrics agree to float rounding
+    // (bench_triangle measures a relative t error below 1e-5 and reports
+    // any hit/miss disagreement, which can only happen for rays grazing an
+    // edge to within rounding).
     virtual bool intersect(const Ray &ray, float tmin, Hit &hit) const override;
 
     bool intersect(const Ray &ray, float tmin, Hit &hit, float tstart, float tend) const;
 
+    virtual bool occluded(const Ray &ray, float tmin, float tmax) const override;
+
     const Vector3f &getVertex(int index) const
     {
         assert(index < 3);
@@ -215,29 +270,68 @@ public:
         return _normals[index];
     }
 
+    // Edge from vertex 0 to vertex index + 1.
+    const Vector3f &getEdge(int index) const
+    {
+        assert(index < 2);
+        return index == 0 ? _e1 : _e2;
+    }
+
+    // Records a hit at t with barycentric weights beta, gamma for
+    // vertices 1 and 2, interpolating the vertex normals.
+    void setHit(Hit &h, float t, float beta, float gamma) const;
+
+    // The Moller-Trumbore test on its own, for a triangle given by vertex
+    // 0 and the edges to vertices 1 and 2. Returns t and the barycentric
+    // weights of vertices 1 and 2, or false if the ray's line misses.
+    static bool mollerTrumbore(const Vector3f &v0, const Vector3f &e1, const Vector3f &e2,
+                               const Ray &r, float &t, float &beta, float &gamma);
+
     Vector3f centroid;
     float centroidX, centroidY, centroidZ;
 
 private:
+    bool mollerTrumbore(const Ray &r, float &t, float &beta, float &gamma) const {
+        return mollerTrumbore(_v[0], _e1, _e2, r, t, beta, gamma);
+    }
+
     Vector3f _v[3];
     Vector3f _normals[3];
+    Vector3f _e1, _e2;
     Material *material;
 };
 
+// FINAL PROJECT
+// Once build() has run, members with a finite box are found through a BVH
+// over their boxes; unbounded members (planes) are tested on every ray.
 class Group : public Object3D
 {
 public:
     // Return true if intersection found
+    virtual ~Group();
+
     virtual bool intersect(const Ray &r, float tmin, Hit &h) const override;
 
+    virtual int intersectPacket(const RayPacket &packet, float tmin, Hit *hits) const override;
+
+    virtual bool occluded(const Ray &r, float tmin, float tmax) const override;
+
     // Add object to group
     void addObject(Object3D *obj);
 
+    // Builds the BVH over the members added so far and updates box.
+    // Adding more objects afterwards falls back to testing every member
+    // until build() is called again. Large groups build on pool, if given.
+    void build(ThreadPool *pool = NULL);
+
     // Return number of objects in group
     int getGroupSize() const;
 
 private:
     std::vector<Object3D *> m_members;
+    BVH *m_bvh = NULL;
+    std::vector<Object3D *> m_bounded;   // indexed by the BVH
+    std::vector<Object3D *> m_unbounded;
 };
 
 // TODO: Implement Plane representing an infinite plane
@@ -249,6 +343,8 @@ public:
 
     virtual bool intersect(const Ray &r, float tmin, Hit &h) const override;
 
+    virtual bool occluded(const Ray &r, float tmin, float tmax) const override;
+
 private:
     float _d;
     Vector3f _normal;
@@ -265,9 +361,25 @@ public:
 
     virtual bool intersect(const Ray &r, float tmin, Hit &h) const override;
 
+    virtual bool occluded(const Ray &r, float tmin, float tmax) const override;
+
 private:
+    // FINAL PROJECT
+    // Ray in object space. t is the same in both spaces.
+    Ray toLocal(const Ray &r) const;
+
     Object3D *_object; //un-transformed object
     Matrix4f M;
+    // FINAL PROJECT
+    // Computed once in the constructor instead of per ray: M's inverse and
+    // its transpose (for normals). When M's bottom row is 0 0 0 1 only the
+    // top three rows of the inverse are needed, kept as plain floats so the
+    // per-ray transform does not go through the vecmath accessors.
+    Matrix4f _worldToLocal;
+    Matrix4f _normalMatrix;
+    bool _affine;
+    float _localRows[3][4];
+    float _normalRows[3][3];
 };
 
 #endif
@@ -2,6 +2,7 @@
 #include "Vector3f.h"
 #include "Mesh.h"
 #include "Octree.h"
+#include "ThreadPool.h"
 
 #include <vector>
 
@@ -46,19 +47,17 @@ inside(const Box &a, const Box &b)
 Box
 trigBox(int t, const Mesh &m)
 {
-    const auto &tri = m.getTriangles();
-
     Box b;
-    b.mn = tri[t].getVertex(0);
-    b.mx = tri[t].getVertex(0);
+    b.mn = m.getVertex(t, 0);
+    b.mx = m.getVertex(t, 0);
 
     for (int ii = 1; ii< 3; ii++) {
         for (int dim = 0; dim < 3; dim++) {
-            if (b.mn[dim] > tri[t].getVertex(ii)[dim]) {
-                b.mn[dim] = tri[t].getVertex(ii)[dim];
+            if (b.mn[dim] > m.getVertex(t, ii)[dim]) {
+                b.mn[dim] = m.getVertex(t, ii)[dim];
             }
-            if (b.mx[dim] < tri[t].getVertex(ii)[dim]) {
-                b.mx[dim] = tri[t].getVertex(ii)[dim];
+            if (b.mx[dim] < m.getVertex(t, ii)[dim]) {
+                b.mx[dim] = m.getVertex(t, ii)[dim];
             }
         }
     }
@@ -71,7 +70,9 @@ Octree::buildNode(OctNode *parent,
                   const Box &pbox,
                   const std::vector<int> &trigs,
                   const Mesh &m,
-                  int level)
+                  int level,
+                  ThreadPool *pool,
+                  int taskDepth)
 {
     if (trigs.size() <= Octree::max_trig || level > maxLevel) {
         parent->obj = trigs;
@@ -99,7 +100,7 @@ Octree::buildNode(OctNode *parent,
     cBox[6] = Box(mid[0], mid[1],  mn[2],  mx[0],  mx[1], mid[2]);
     cBox[7] = Box(mid[0], mid[1], mid[2],  mx[0],  mx[1],  mx[2]);
 
-    for (int ii = 0; ii < 8; ii++) {
+    auto buildChild = [&](int ii) {
         std::vector<int> childTrigs;
         for (unsigned int vi = 0; vi < trigs.size(); vi++) {
             int trigIdx = trigs[vi];
@@ -108,25 +109,34 @@ Octree::buildNode(OctNode *parent,
                 childTrigs.push_back(trigIdx);
             }
         }
-        buildNode(parent->child[ii], cBox[ii], childTrigs, m, level);
+        buildNode(parent->child[ii], cBox[ii], childTrigs, m, level, pool, taskDepth);
+    };
+    // FINAL PROJECT
+    // Near the root the children are built in parallel; each one only
+    // touches its own node and list.
+    if (level <= taskDepth) {
+        pool->parallelFor(8, buildChild);
+        return;
+    }
+    for (int ii = 0; ii < 8; ii++) {
+        buildChild(ii);
     }
 }
 
 void
-Octree::build(Mesh *m)
+Octree::build(Mesh *m, ThreadPool *pool)
 {
     mesh = m;
 
-    const auto &tri = mesh->getTriangles();
-    assert(!tri.empty());
+    int numTrigs = mesh->numTriangles();
+    assert(numTrigs > 0);
 
     // compute bounding box for m
-    box.mn = tri[0].getVertex(0);
-    box.mx = tri[0].getVertex(0);
-    for (unsigned int ii = 0; ii < tri.size(); ii++) {
-        const auto &t = tri[ii];
+    box.mn = mesh->getVertex(0, 0);
+    box.mx = mesh->getVertex(0, 0);
+    for (int ii = 0; ii < numTrigs; ii++) {
         for (int vi = 0; vi < 3; ++vi) {
-            const auto &v = t.getVertex(vi);
+            const auto &v = mesh->getVertex(ii, vi);
             for (int dim = 0; dim < 3; dim++) {
                 if (box.mn[dim] > v[dim]) {
                     box.mn[dim] = v[dim];
@@ -138,11 +148,11 @@ Octree::build(Mesh *m)
         }
     }
 
-    std::vector<int> trigs(tri.size());
+    std::vector<int> trigs(numTrigs);
     for (unsigned int ii = 0; ii < trigs.size(); ii++) {
         trigs[ii] = ii;
     }
-    buildNode(&root, box, trigs, *mesh, 0);
+    buildNode(&root, box, trigs, *mesh, 0, pool, pool ? pool->taskDepth(8) : 0);
 }
 
 int
@@ -205,8 +215,12 @@ Octree::proc_subtree(float tx0,
                      float tx1, 
                      float ty1, 
                      float tz1, 
-                     OctNode *node,
-                     const Ray &ray)
+                     const OctNode *node,
+                     const Ray &ray,
+                     float tmin,
+                     Hit &h,
+                     uint8_t aa,
+                     bool anyHit) const
 {
     bool intersected = false;
 
@@ -214,15 +228,23 @@ Octree::proc_subtree(float tx0,
         return intersected;
     }
 
+    // FINAL PROJECT
     if (node->isTerm()) {
+        Stats::count(Stats::LEAF_VISITS);
         //loop over things
         for (size_t ii = 0; ii < node->obj.size(); ii++) {
-            bool result = mesh->intersectTrig(node->obj[ii],ray);
+            // Any-hit queries exclude tmax, like every other occluded.
+            bool result = anyHit ? mesh->occludedTrig(node->obj[ii], ray, tmin, h.getT())
+                                 : mesh->intersectTrig(node->obj[ii], ray, tmin, h);
             intersected = intersected || result;
+            if (anyHit && intersected) {
+                return true;
+            }
         }
         return intersected;
     }
 
+    Stats::count(Stats::NODE_VISITS);
     float txm = 0.5f * (tx0 + tx1);
     float tym = 0.5f * (ty0 + ty1);  
     float tzm = 0.5f * (tz0 + tz1);  
@@ -230,43 +252,67 @@ Octree::proc_subtree(float tx0,
     do {
         switch (currNode) {
         case 0: {
-            bool result = proc_subtree(tx0, ty0, tz0, txm, tym, tzm, node->child[aa],ray);
+            bool result = proc_subtree(tx0, ty0, tz0, txm, tym, tzm, node->child[aa], ray, tmin, h, aa, anyHit);
             intersected |= result;
+            if (anyHit && intersected) {
+                return true;
+            }
             currNode = new_node(txm, 4, tym, 2, tzm, 1);
         } break;
         case 1: {
-            bool result = proc_subtree(tx0, ty0, tzm, txm, tym, tz1, node->child[1^aa],ray);
+            bool result = proc_subtree(tx0, ty0, tzm, txm, tym, tz1, node->child[1^aa], ray, tmin, h, aa, anyHit);
             intersected |= result;
+            if (anyHit && intersected) {
+                return true;
+            }
             currNode = new_node(txm, 5, tym, 3, tz1, 8);
         } break;
         case 2: {
-            bool result = proc_subtree(tx0, tym, tz0, txm, ty1, tzm, node->child[2^aa],ray);
+            bool result = proc_subtree(tx0, tym, tz0, txm, ty1, tzm, node->child[2^aa], ray, tmin, h, aa, anyHit);
             intersected |= result;
+            if (anyHit && intersected) {
+                return true;
+            }
             currNode = new_node(txm, 6, ty1, 8, tzm, 3);
         } break;
         case 3: {
-            bool result = proc_subtree(tx0, tym, tzm, txm, ty1, tz1, node->child[3^aa],ray);
+            bool result = proc_subtree(tx0, tym, tzm, txm, ty1, tz1, node->child[3^aa], ray, tmin, h, aa, anyHit);
             intersected |= result;
+            if (anyHit && intersected) {
+                return true;
+            }
             currNode = new_node(txm, 7, ty1, 8, tz1, 8);
         } break;
         case 4: {
-            bool result = proc_subtree(txm, ty0, tz0, tx1, tym, tzm, node->child[4^aa],ray);
+            bool result = proc_subtree(txm, ty0, tz0, tx1, tym, tzm, node->child[4^aa], ray, tmin, h, aa, anyHit);
             intersected |= result;
+            if (anyHit && intersected) {
+                return true;
+            }
             currNode = new_node(tx1, 8, tym, 6, tzm, 5);
         } break;
         case 5: {
-            bool result = proc_subtree(txm, ty0, tzm, tx1, tym, tz1, node->child[5^aa],ray);
+            bool result = proc_subtree(txm, ty0, tzm, tx1, tym, tz1, node->child[5^aa], ray, tmin, h, aa, anyHit);
             intersected |= result;
+            if (anyHit && intersected) {
+                return true;
+            }
             currNode = new_node(tx1, 8, tym, 7, tz1, 8);
         } break;
         case 6: {
-            bool result = proc_subtree(txm, tym, tz0, tx1, ty1, tzm, node->child[6^aa],ray);
+            bool result = proc_subtree(txm, tym, tz0, tx1, ty1, tzm, node->child[6^aa], ray, tmin, h, aa, anyHit);
             intersected |= result;
+            if (anyHit && intersected) {
+                return true;
+            }
             currNode = new_node(tx1, 8, ty1, 8, tzm, 7);
         } break;
         case 7: {
-            bool result = proc_subtree(txm, tym, tzm, tx1, ty1, tz1, node->child[7^aa],ray);
+            bool result = proc_subtree(txm, tym, tzm, tx1, ty1, tz1, node->child[7^aa], ray, tmin, h, aa, anyHit);
             intersected |= result;
+            if (anyHit && intersected) {
+                return true;
+            }
             currNode = 8;
         } break;
         }
@@ -276,7 +322,22 @@ Octree::proc_subtree(float tx0,
 }
 
 bool
-Octree::intersect(const Ray &ray)
+Octree::intersect(const Ray &ray, float tmin, Hit &h) const
+{
+    return traverse(ray, tmin, h, false);
+}
+
+bool
+Octree::occluded(const Ray &ray, float tmin, float tmax) const
+{
+    // Only hits before tmax count.
+    Hit h;
+    h.t = tmax;
+    return traverse(ray, tmin, h, true);
+}
+
+bool
+Octree::traverse(const Ray &ray, float tmin, Hit &h, bool anyHit) const
 {
     Vector3f rd = ray.getDirection();
 
@@ -284,7 +345,7 @@ Octree::intersect(const Ray &ray)
     rd.normalize();
     Vector3f ro = ray.getOrigin();
 
-    aa = 0;
+    uint8_t aa = 0;
     Vector3f size = box.mx + box.mn;
     if (rd[0]<0.0f) {
         ro[0] = size[0] - ro[0];
@@ -312,6 +373,8 @@ Octree::intersect(const Ray &ray)
     float divz = 1 / rd[2];
 #endif
 
+    // FINAL PROJECT
+    Stats::count(Stats::BOX_TESTS);
     float tx0 = (box.mn[0] - ro[0]) * divx;
     float tx1 = (box.mx[0] - ro[0]) * divx;
     float ty0 = (box.mn[1] - ro[1]) * divy;
@@ -320,7 +383,7 @@ Octree::intersect(const Ray &ray)
     float tz1 = (box.mx[2] - ro[2]) * divz;
 
     if (std::max(std::max(tx0,ty0), tz0) <= std::min(std::min(tx1, ty1), tz1)) {
-        return proc_subtree(tx0, ty0, tz0, tx1, ty1, tz1, &root, ray);
+        return proc_subtree(tx0, ty0, tz0, tx1, ty1, tz1, &root, ray, tmin, h, aa, anyHit);
     } else {
         return false;
     }
@@ -2,6 +2,7 @@
 #define OCTREE_HPP
 
 class Mesh;
+class ThreadPool;
 
 struct Box
 {
@@ -37,7 +38,7 @@ struct OctNode
     }
 
     ///@brief is this terminal
-    bool isTerm() {
+    bool isTerm() const {
         return child[0] == nullptr;
     }
 
@@ -52,20 +53,37 @@ class Octree
     {
     }
 
-    void build(Mesh *m);
+    // FINAL PROJECT
+    // With a pool, the nodes near the root build their children as
+    // parallel tasks.
+    void build(Mesh *m, ThreadPool *pool = NULL);
 
-    bool intersect(const Ray &ray);
+    bool intersect(const Ray &ray, float tmin, Hit &h) const;
+
+    // FINAL PROJECT
+    // True if any triangle is hit with t in [tmin, tmax). Stops at the
+    // first such hit.
+    bool occluded(const Ray &ray, float tmin, float tmax) const;
 
   private:
+    // Shared by intersect and occluded; with anyHit set the traversal
+    // returns as soon as something is hit before h's t.
+    bool traverse(const Ray &ray, float tmin, Hit &h, bool anyHit) const;
+
     void buildNode(OctNode *parent, 
                    const Box &pbox,
                    const std::vector<int> &trigs, 
                    const Mesh &m, 
-                   int level);
+                   int level,
+                   ThreadPool *pool,
+                   int taskDepth);
 
+    // aa holds the octant mirroring bits for the ray being traced. It is
+    // passed down rather than stored so several threads can share a tree.
     bool proc_subtree(float tx0, float ty0, float tz0, 
                       float tx1, float ty1, float tz1, 
-                      OctNode *node, const Ray &r);
+                      const OctNode *node, const Ray &r,
+                      float tmin, Hit &h, uint8_t aa, bool anyHit) const;
 
     // if a node contains more than 7 triangles and it 
     // hasn't reached the max level yet, split
@@ -75,7 +93,6 @@ class Octree
     Mesh *mesh;
     Box box;
     OctNode root;
-    uint8_t aa;
 };
 
 #endif
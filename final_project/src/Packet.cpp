@@ -0,0 +1,113 @@
+#include "Packet.h"
+
+#include "KDNode.h"
+#include "Ray.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Defined in PacketAVX2.cpp; false if that file was built without AVX2.
+extern const bool packet8Compiled;
+
+void
+RayPacket::set(const Ray *rays, int count)
+{
+    this->rays = rays;
+    size = count;
+    coherent = true;
+    for (int i = 0; i < count; ++i) {
+        const Ray &r = rays[i];
+        ox[i] = r.orig[0]; oy[i] = r.orig[1]; oz[i] = r.orig[2];
+        dx[i] = r.dir[0]; dy[i] = r.dir[1]; dz[i] = r.dir[2];
+        ix[i] = r.invdir[0]; iy[i] = r.invdir[1]; iz[i] = r.invdir[2];
+        for (int a = 0; a < 3; ++a) {
+            if (r.dir[a] == 0 || r.sign[a] != rays[0].sign[a] ||
+                r.orig[a] != rays[0].orig[a]) {
+                coherent = false;
+            }
+        }
+    }
+    // Give the unused lanes a harmless copy of lane 0.
+    for (int i = count; i < MAX_SIZE; ++i) {
+        ox[i] = ox[0]; oy[i] = oy[0]; oz[i] = oz[0];
+        dx[i] = dx[0]; dy[i] = dy[0]; dz[i] = dz[0];
+        ix[i] = ix[0]; iy[i] = iy[0]; iz[i] = iz[0];
+    }
+}
+
+int
+packetWidth()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    // The 4-wide kernel is only compiled in with SSE2 (see Lanes4); without
+    // it intersectPacket4 is a stub.
+#if defined(__SSE2__)
+    static const bool sse2 = __builtin_cpu_supports("sse2");
+#else
+    static const bool sse2 = false;
+#endif
+    static const int width =
+        packet8Compiled && __builtin_cpu_supports("avx2") ? 8 : sse2 ? 4 : 1;
+    return width;
+#else
+    return 1;
+#endif
+}
+
+#if defined(__SSE2__)
+
+namespace {
+
+struct Lanes4
+{
+    typedef __m128 F;
+    static const int WIDTH = 4;
+
+    static F load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, F a) { _mm_storeu_ps(p, a); }
+    static F set1(float a) { return _mm_set1_ps(a); }
+    static F add(F a, F b) { return _mm_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm_div_ps(a, b); }
+    static F lt(F a, F b) { return _mm_cmplt_ps(a, b); }
+    static F le(F a, F b) { return _mm_cmple_ps(a, b); }
+    static F gt(F a, F b) { return _mm_cmpgt_ps(a, b); }
+    static F ge(F a, F b) { return _mm_cmpge_ps(a, b); }
+    static F eq(F a, F b) { return _mm_cmpeq_ps(a, b); }
+    static F or_(F a, F b) { return _mm_or_ps(a, b); }
+    static F andnot(F a, F b) { return _mm_andnot_ps(a, b); }
+    static F blend(F mask, F a, F b)
+    {
+        return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+    }
+    static int bits(F mask) { return _mm_movemask_ps(mask); }
+    static F fromBits(int bits)
+    {
+        __m128i lane = _mm_setr_epi32(1, 2, 4, 8);
+        __m128i set = _mm_and_si128(_mm_set1_epi32(bits), lane);
+        return _mm_castsi128_ps(_mm_cmpeq_epi32(set, lane));
+    }
+};
+
+#include "PacketKernel.inl"
+
+} // namespace
+
+int
+intersectPacket4(const PacketScene &scene, const RayPacket &packet,
+                 float tmin, PacketHits &hits)
+{
+    return tracePacket<Lanes4>(scene, packet, tmin, hits);
+}
+
+#else
+
+int
+intersectPacket4(const PacketScene &, const RayPacket &, float, PacketHits &)
+{
+    return 0;
+}
+
+#endif
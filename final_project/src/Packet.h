@@ -0,0 +1,81 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+
+// Only forward declarations here: the AVX2 kernel is compiled with -mavx2,
+// and any inline function it pulled in from other headers could end up
+// being the copy the whole program links against.
+class Ray;
+struct KDNode;
+
+// FINAL PROJECT
+// Packets of up to 8 rays, traced together through a mesh's KD tree with
+// SSE (4 lanes) or AVX2 (8 lanes).
+//
+// The packet kernels make exactly the same decisions as the scalar
+// FlatKDTree::intersect for every lane, with the same float operations in
+// the same order, so a packet-traced image is identical to a scalar one.
+
+// Rays in structure-of-arrays form. Lanes past size are unused.
+struct RayPacket
+{
+    static const int MAX_SIZE = 8;
+
+    // Copies count (<= MAX_SIZE) rays; rays must outlive the packet.
+    void set(const Ray *rays, int count);
+
+    int size;
+    // The original rays, for objects without a packet path.
+    const Ray *rays;
+    // All rays share one origin, every direction component is nonzero and
+    // has the same sign in all rays. The KD kernels need this to visit the
+    // children of a node in the same order for every lane.
+    bool coherent;
+
+    alignas(32) float ox[MAX_SIZE], oy[MAX_SIZE], oz[MAX_SIZE];
+    alignas(32) float dx[MAX_SIZE], dy[MAX_SIZE], dz[MAX_SIZE];
+    alignas(32) float ix[MAX_SIZE], iy[MAX_SIZE], iz[MAX_SIZE];
+};
+
+// Widest packet the kernels can trace on this CPU: 8 with AVX2, 4 with
+// SSE, 1 if neither kernel was compiled in.
+int packetWidth();
+
+// Everything a packet kernel reads, as plain arrays.
+struct PacketScene
+{
+    // Same as FlatKDTree::MAX_DEPTH.
+    static const int MAX_DEPTH = 64;
+
+    const KDNode *nodes;
+    const uint32_t *indices;
+    // 9 floats per triangle: vertex 0, edge 1 - 0, edge 2 - 0.
+    const float *triangles;
+    float boxMin[3], boxMax[3];
+};
+
+// Closest hit per lane. t is read as the current closest hit and updated;
+// triangle, beta and gamma are only written for lanes that found a closer
+// hit.
+struct PacketHits
+{
+    float t[RayPacket::MAX_SIZE];
+    uint32_t triangle[RayPacket::MAX_SIZE];
+    float beta[RayPacket::MAX_SIZE];
+    float gamma[RayPacket::MAX_SIZE];
+    // Work done for the whole packet, for -stats.
+    uint32_t nodeVisits;
+    uint32_t leafVisits;
+    uint32_t triangleTests;
+};
+
+// Trace a coherent packet of at most 4 (SSE) or 8 (AVX2) rays. Return a
+// mask with bit i set if lane i found a closer hit. Only call these with
+// packets no wider than packetWidth().
+int intersectPacket4(const PacketScene &scene, const RayPacket &packet,
+                     float tmin, PacketHits &hits);
+int intersectPacket8(const PacketScene &scene, const RayPacket &packet,
+                     float tmin, PacketHits &hits);
+
+#endif // PACKET_H
@@ -0,0 +1,68 @@
+// FINAL PROJECT
+// 8-wide packet kernel. CMake compiles this file alone with -mavx2, so it
+// must not call anything outside it; packetWidth() only picks it on CPUs
+// that have AVX2.
+
+#include "Packet.h"
+
+#include "KDNode.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+extern const bool packet8Compiled = true;
+
+namespace {
+
+struct Lanes8
+{
+    typedef __m256 F;
+    static const int WIDTH = 8;
+
+    static F load(const float *p) { return _mm256_loadu_ps(p); }
+    static void store(float *p, F a) { _mm256_storeu_ps(p, a); }
+    static F set1(float a) { return _mm256_set1_ps(a); }
+    static F add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm256_div_ps(a, b); }
+    static F lt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static F le(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static F gt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static F ge(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static F eq(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+    static F or_(F a, F b) { return _mm256_or_ps(a, b); }
+    static F andnot(F a, F b) { return _mm256_andnot_ps(a, b); }
+    static F blend(F mask, F a, F b) { return _mm256_blendv_ps(b, a, mask); }
+    static int bits(F mask) { return _mm256_movemask_ps(mask); }
+    static F fromBits(int bits)
+    {
+        __m256i lane = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        __m256i set = _mm256_and_si256(_mm256_set1_epi32(bits), lane);
+        return _mm256_castsi256_ps(_mm256_cmpeq_epi32(set, lane));
+    }
+};
+
+#include "PacketKernel.inl"
+
+} // namespace
+
+int
+intersectPacket8(const PacketScene &scene, const RayPacket &packet,
+                 float tmin, PacketHits &hits)
+{
+    return tracePacket<Lanes8>(scene, packet, tmin, hits);
+}
+
+#else
+
+extern const bool packet8Compiled = false;
+
+int
+intersectPacket8(const PacketScene &, const RayPacket &, float, PacketHits &)
+{
+    return 0;
+}
+
+#endif
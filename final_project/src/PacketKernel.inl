@@ -0,0 +1,195 @@
+// FINAL PROJECT
+// Packet traversal of a FlatKDTree, shared by the SSE and AVX2 kernels.
+//
+// Included by Packet.cpp and PacketAVX2.cpp inside an anonymous namespace,
+// after they define a lane type V with:
+//   typedef ... F;                 one float per lane
+//   static const int WIDTH;        number of lanes
+//   load, store, set1, add, sub, mul, div
+//   lt, le, gt, ge, eq             ordered compares, all-ones mask per lane
+//   or_, andnot(a, b) = ~a & b, blend(mask, a, b) = mask ? a : b
+//   bits(mask)                     one bit per lane, as in movemask
+//   fromBits(bits)                 the inverse of bits()
+//
+// Every lane goes through exactly the steps FlatKDTree::intersect would
+// take for its ray: the same box test, the same front/back/both choice at
+// each node, the same early exit, and the same Moller-Trumbore arithmetic
+// as Triangle::mollerTrumbore, in the same order. Only nodes are shared;
+// a lane that would not visit a node is masked off while the others do.
+// Relies on the packet being coherent (see RayPacket::coherent), so that
+// the near child of every node is the same for all lanes.
+
+template <class V>
+int
+tracePacket(const PacketScene &scene, const RayPacket &p, float tmin,
+            PacketHits &hits)
+{
+    typedef typename V::F F;
+    const int N = V::WIDTH;
+
+    F orig[3] = { V::load(p.ox), V::load(p.oy), V::load(p.oz) };
+    F dir[3] = { V::load(p.dx), V::load(p.dy), V::load(p.dz) };
+    F inv[3] = { V::load(p.ix), V::load(p.iy), V::load(p.iz) };
+    hits.nodeVisits = hits.leafVisits = hits.triangleTests = 0;
+
+    // Slab test against the root box, as in BoundingBox::intersect. The
+    // direction signs are the same in every lane, so so is the choice of
+    // near and far planes.
+    F tnear[3], tfar[3];
+    for (int a = 0; a < 3; ++a) {
+        bool negative = (a == 0 ? p.ix[0] : a == 1 ? p.iy[0] : p.iz[0]) < 0;
+        float lo = negative ? scene.boxMax[a] : scene.boxMin[a];
+        float hi = negative ? scene.boxMin[a] : scene.boxMax[a];
+        tnear[a] = V::mul(V::sub(V::set1(lo), orig[a]), inv[a]);
+        tfar[a] = V::mul(V::sub(V::set1(hi), orig[a]), inv[a]);
+    }
+    F miss = V::or_(V::gt(tnear[0], tfar[1]), V::gt(tnear[1], tfar[0]));
+    F ts = V::blend(V::gt(tnear[1], tnear[0]), tnear[1], tnear[0]);
+    F te = V::blend(V::lt(tfar[1], tfar[0]), tfar[1], tfar[0]);
+    miss = V::or_(miss, V::or_(V::gt(ts, tfar[2]), V::gt(tnear[2], te)));
+    ts = V::blend(V::gt(tnear[2], ts), tnear[2], ts);
+    te = V::blend(V::lt(tfar[2], te), tfar[2], te);
+
+    int active = ((1 << p.size) - 1) & ~V::bits(miss);
+    if (!active)
+        return 0;
+
+    F tHit = V::load(hits.t);
+    F beta = V::load(hits.beta);
+    F gamma = V::load(hits.gamma);
+    const F zero = V::set1(0);
+    const F one = V::set1(1);
+    const F allOnes = V::eq(zero, zero);
+    const F tminV = V::set1(tmin);
+
+    struct Entry
+    {
+        uint32_t node;
+        int active;
+        float tstart[N], tend[N];
+    } stack[PacketScene::MAX_DEPTH];
+    int top = 0;
+
+    int found = 0;
+    int finished = 0;
+    uint32_t current = 0;
+    while (true) {
+        // Lanes whose closest hit lies before this node are done, just as
+        // the scalar loop breaks out.
+        int done = V::bits(V::lt(tHit, ts)) & active;
+        finished |= done;
+        active &= ~done;
+
+        const KDNode &node = scene.nodes[current];
+        if (active && (node.flags & 3) != 3) {
+            hits.nodeVisits++;
+            int axis = node.flags & 3;
+            float split = node.split;
+            F t = V::mul(V::sub(V::set1(split), orig[axis]), inv[axis]);
+            uint32_t front = node.flags >> 2, back = front + 1;
+            float o = axis == 0 ? p.ox[0] : axis == 1 ? p.oy[0] : p.oz[0];
+            float d = axis == 0 ? p.dx[0] : axis == 1 ? p.dy[0] : p.dz[0];
+            if (!((o < split) || (o == split && d <= 0))) {
+                uint32_t tmp = front;
+                front = back;
+                back = tmp;
+            }
+
+            // Same 3 cases as KDTree::traverse, per lane.
+            F frontOnly = V::or_(V::ge(t, te), V::le(t, zero));
+            F both = V::andnot(V::or_(frontOnly, V::le(t, ts)), allOnes);
+            int bothBits = V::bits(both) & active;
+            int frontBits = (V::bits(frontOnly) & active) | bothBits;
+            int backBits = (active & ~frontBits) | bothBits;
+            if (frontBits && backBits) {
+                Entry &e = stack[top++];
+                e.node = back;
+                e.active = backBits;
+                V::store(e.tstart, V::blend(both, t, ts));
+                V::store(e.tend, te);
+                te = V::blend(both, t, te);
+                current = front;
+                active = frontBits;
+            } else if (frontBits) {
+                current = front;
+                active = frontBits;
+            } else {
+                current = back;
+                active = backBits;
+            }
+            continue;
+        }
+
+        if (active) {
+            F act = V::fromBits(active);
+            const uint32_t *index = &scene.indices[node.offset];
+            hits.leafVisits++;
+            hits.triangleTests += node.flags >> 2;
+            for (uint32_t i = 0; i < (node.flags >> 2); i++) {
+                const float *tri = &scene.triangles[9 * index[i]];
+                F v0[3] = { V::set1(tri[0]), V::set1(tri[1]), V::set1(tri[2]) };
+                F e1[3] = { V::set1(tri[3]), V::set1(tri[4]), V::set1(tri[5]) };
+                F e2[3] = { V::set1(tri[6]), V::set1(tri[7]), V::set1(tri[8]) };
+
+                // p = cross(dir, e2), det = dot(e1, p)
+                F px = V::sub(V::mul(dir[1], e2[2]), V::mul(dir[2], e2[1]));
+                F py = V::sub(V::mul(dir[2], e2[0]), V::mul(dir[0], e2[2]));
+                F pz = V::sub(V::mul(dir[0], e2[1]), V::mul(dir[1], e2[0]));
+                F det = V::add(V::add(V::mul(e1[0], px), V::mul(e1[1], py)),
+                               V::mul(e1[2], pz));
+                F reject = V::eq(det, zero);
+                F invDet = V::div(one, det);
+
+                // s = orig - v0, beta = dot(s, p) / det
+                F sx = V::sub(orig[0], v0[0]);
+                F sy = V::sub(orig[1], v0[1]);
+                F sz = V::sub(orig[2], v0[2]);
+                F b = V::mul(V::add(V::add(V::mul(sx, px), V::mul(sy, py)),
+                                    V::mul(sz, pz)), invDet);
+                reject = V::or_(reject, V::or_(V::lt(b, zero), V::gt(b, one)));
+
+                // q = cross(s, e1), gamma = dot(dir, q) / det
+                F qx = V::sub(V::mul(sy, e1[2]), V::mul(sz, e1[1]));
+                F qy = V::sub(V::mul(sz, e1[0]), V::mul(sx, e1[2]));
+                F qz = V::sub(V::mul(sx, e1[1]), V::mul(sy, e1[0]));
+                F g = V::mul(V::add(V::add(V::mul(dir[0], qx), V::mul(dir[1], qy)),
+                                    V::mul(dir[2], qz)), invDet);
+                reject = V::or_(reject, V::or_(V::lt(g, zero),
+                                               V::gt(V::add(b, g), one)));
+
+                // t = dot(e2, q) / det
+                F t = V::mul(V::add(V::add(V::mul(e2[0], qx), V::mul(e2[1], qy)),
+                                    V::mul(e2[2], qz)), invDet);
+                reject = V::or_(reject, V::or_(V::gt(t, tHit), V::lt(t, tminV)));
+
+                F accept = V::andnot(reject, act);
+                int acceptBits = V::bits(accept);
+                if (!acceptBits)
+                    continue;
+                tHit = V::blend(accept, t, tHit);
+                beta = V::blend(accept, b, beta);
+                gamma = V::blend(accept, g, gamma);
+                for (int lane = 0; lane < N; ++lane) {
+                    if (acceptBits & (1 << lane))
+                        hits.triangle[lane] = index[i];
+                }
+                found |= acceptBits;
+            }
+        }
+
+        // Next node on the stack, for the lanes that are still going.
+        do {
+            if (top == 0) {
+                V::store(hits.t, tHit);
+                V::store(hits.beta, beta);
+                V::store(hits.gamma, gamma);
+                return found;
+            }
+            top--;
+            active = stack[top].active & ~finished;
+        } while (!active);
+        current = stack[top].node;
+        ts = V::load(stack[top].tstart);
+        te = V::load(stack[top].tend);
+    }
+}
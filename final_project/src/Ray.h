@@ -55,13 +55,15 @@ class Hit
 public:
     // Constructors
     Hit() :
-        material(NULL),
-        t(std::numeric_limits<float>::max())
+        t(std::numeric_limits<float>::max()),
+        triangle(-1),
+        material(NULL)
     {
     }
 
     Hit(float argt, Material *argmaterial, const Vector3f &argnormal) :
         t(argt),
+        triangle(-1),
         material(argmaterial),
         normal(argnormal)
     {
@@ -85,15 +87,35 @@ public:
     void set(float t, Material *material, const Vector3f &normal)
     {
         this->t = t;
+        this->triangle = -1;
         this->material = material;
         this->normal = normal;
     }
 
+    // FINAL PROJECT
+    // Records a closer hit on a mesh triangle without its material and
+    // normal, which the mesh fills in for the closest one when the
+    // traversal is done. Until then the barycentric weights are kept
+    // where the material goes, so a Hit stays 32 bytes.
+    void setTriangle(float t, int triangle, float beta, float gamma)
+    {
+        this->t = t;
+        this->triangle = triangle;
+        this->barycentric[0] = beta;
+        this->barycentric[1] = gamma;
+    }
+
     float     t;
-    Material* material;
+    int       triangle;     // mesh triangle index, -1 for other objects
+    union {
+        Material* material;
+        float     barycentric[2];  // beta and gamma, until the mesh sets material
+    };
     Vector3f  normal;
 };
 
+static_assert(sizeof(Hit) <= 32, "Hit should fill half a cache line");
+
 inline std::ostream &
 operator<<(std::ostream &os, const Hit &h)
 {
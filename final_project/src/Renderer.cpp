@@ -2,67 +2,831 @@
 
 #include "ArgParser.h"
 #include "Camera.h"
+#include "Film.h"
 #include "Image.h"
+#include "ImageWriter.h"
 #include "Ray.h"
+#include "Stats.h"
 #include "VecUtils.h"
 #include "KDTree.h"
-#include "KDTree.cpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <stdint.h>
 
 #include <limits>
+#include <memory>
 
 KDTree *root = NULL;
 
+// FINAL PROJECT
+// ArgParser has already rejected unknown names.
+static MeshAccel
+meshAccel(const std::string &name) {
+    MeshAccel accel = ACCEL_KDTREE;
+    Mesh::parseAccel(name, accel);
+    return accel;
+}
+
 Renderer::Renderer(const ArgParser &args) :
     _args(args),
-    _scene(args.input_file) {}
+    _start(std::chrono::steady_clock::now()),
+    _pool(args.threads),
+    _scene(args.input_file, meshAccel(args.accel), &_pool),
+    _packetWidth(0) {
+    // FINAL PROJECT
+    if (args.packets > 0) {
+        _packetWidth = std::min(args.packets > 4 ? 8 : 4, packetWidth());
+        if (_packetWidth < 4) {
+            std::cout << "No SIMD packet kernel on this CPU, tracing packets ray by ray" << std::endl;
+        } else if (_packetWidth != args.packets) {
+            std::cout << "Tracing " << _packetWidth << "-wide packets" << std::endl;
+        }
+    }
+}
+
+// FINAL PROJECT
+// Edge length, in pixels, of the square tiles handed out to the thread pool.
+static const int TILE_SIZE = 32;
+
+// Pixels per band of a streamed render (at least TILE_SIZE rows).
+static const int BAND_PIXELS = 1 << 18;
+
+static Image::PixelFormat
+pixelFormat(const std::string &name) {
+    return name == "rgb8" ? Image::RGB8 :
+           name == "half" ? Image::RGB16F :
+           name == "rgbe" ? Image::RGBE : Image::RGB32F;
+}
 
 void
 Renderer::Render() {
     int w = _args.width;
     int h = _args.height;
 
-    Image image(w, h);
-    Image nimage(w, h);
-    Image dimage(w, h);
+    // FINAL PROJECT
+    Stats::Timer renderTimer(Stats::RENDER);
+    if (_args.time_budget <= 0 && !(_args.samples > 1 || _args.jitter || _args.filter ||
+                                    _args.adaptive_threshold > 0)) {
+        renderStreamed();
+        return;
+    }
 
-    // loop through all the pixels in the image
-    // generate all the samples
+    // Sampled and progressive rendering need the whole frame. Images that
+    // were not asked for get no pixels.
+    Image::PixelFormat format = pixelFormat(_args.pixel_format);
+    Image image(w, h, format);
+    Image nimage = _args.normals_file.empty() ? Image() : Image(w, h, format);
+    Image dimage = _args.depth_file.empty() ? Image() : Image(w, h, format);
+    if (_args.time_budget > 0) {
+        renderProgressive(image, nimage, dimage);
+    } else {
+        renderSampled(image, nimage, dimage);
+    }
 
-    // This look generates camera rays and callse traceRay.
-    // It also write to the color, normal, and depth images.
-    // You should understand what this code does.
+    renderTimer.stop();
+
+    // save the files
+    Stats::Timer pngTimer(Stats::PNG_ENCODE);
+    if (_args.output_file.size()) {
+        image.save(_args.output_file);
+    }
+    if (_args.depth_file.size()) {
+        dimage.save(_args.depth_file);
+    }
+    if (_args.normals_file.size()) {
+        nimage.save(_args.normals_file);
+    }
+}
+
+void
+Renderer::renderStreamed() {
+    int w = _args.width;
+    int h = _args.height;
+    int rows = std::min(std::max(1, BAND_PIXELS / w / TILE_SIZE) * TILE_SIZE, h);
+
+    Image::PixelFormat format = pixelFormat(_args.pixel_format);
+    Image image(w, rows, format);
+    Image nimage = _args.normals_file.empty() ? Image() : Image(w, rows, format);
+    Image dimage = _args.depth_file.empty() ? Image() : Image(w, rows, format);
+    const std::string *files[3] = { &_args.output_file, &_args.normals_file, &_args.depth_file };
+    Image *images[3] = { &image, &nimage, &dimage };
+    std::unique_ptr<ImageWriter> writers[3];
+    for (int i = 0; i < 3; ++i) {
+        if (!files[i]->empty()) {
+            writers[i].reset(new ImageWriter(*files[i], w, h, ImageWriter::formatFor(*files[i])));
+        }
+    }
+
+    // Bands go from the top of the image down, the order in which PNG
+    // stores its rows.
+    for (int top = h; top > 0; top -= rows) {
+        int bottom = std::max(top - rows, 0);
+        for (Image *im : images) {
+            im->setFirstRow(bottom);
+        }
+        if (_args.wavefront) {
+            renderWavefront(bottom, top, image, nimage, dimage);
+        } else {
+            // Split the band into tiles and let the pool work through them.
+            // Every pixel is computed exactly as in a serial loop and each
+            // tile writes a disjoint set of pixels, so the output does not
+            // depend on the number of threads or on the order in which
+            // tiles finish.
+            forEachTile(false, bottom, top, [&](int x0, int y0, int x1, int y1) {
+                renderTile(x0, y0, x1, y1, image, nimage, dimage);
+            });
+        }
+
+        Stats::Timer pngTimer(Stats::PNG_ENCODE);
+        for (int i = 0; i < 3; ++i) {
+            if (writers[i]) {
+                writers[i]->writeRows(*images[i], bottom, top);
+            }
+        }
+    }
+
+    Stats::Timer pngTimer(Stats::PNG_ENCODE);
+    for (int i = 0; i < 3; ++i) {
+        if (writers[i]) {
+            writers[i]->finish();
+        }
+    }
+}
+
+void
+Renderer::forEachTile(bool spread, int rowBegin, int rowEnd,
+                      const std::function<void(int, int, int, int)> &body) {
+    int w = _args.width;
+    int tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (rowEnd - rowBegin + TILE_SIZE - 1) / TILE_SIZE;
+
+    // Spread out, each round takes every other tile in x and y, starting
+    // from a different corner.
+    int step = spread ? 2 : 1;
+    for (int round = 0; round < step * step; ++round) {
+        int firstX = round % step;
+        int firstY = round / step;
+        int countX = (tilesX - firstX + step - 1) / step;
+        int countY = (tilesY - firstY + step - 1) / step;
+        if (countX <= 0 || countY <= 0) {
+            continue;
+        }
+        _pool.parallelFor(countX * countY, [&](int tile) {
+            int x0 = (firstX + (tile % countX) * step) * TILE_SIZE;
+            int y0 = rowBegin + (firstY + (tile / countX) * step) * TILE_SIZE;
+            body(x0, y0, std::min(x0 + TILE_SIZE, w), std::min(y0 + TILE_SIZE, rowEnd));
+        });
+    }
+}
+
+// FINAL PROJECT
+// Jitter comes from a hash of the pixel and the pass, so a pixel gets the
+// same samples whichever thread renders it.
+static uint32_t
+pixelSeed(int x, int y, int pass) {
+    uint32_t h = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)(pass + 1) * 83492791u;
+    h ^= h >> 16; h *= 0x85ebca6bu;
+    h ^= h >> 13; h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h ? h : 1;
+}
+
+// xorshift32, returns a float in [0, 1).
+static float
+nextRandom(uint32_t &state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+// FINAL PROJECT
+// Seeds Russian roulette from the bits of a reflection ray, so a path
+// makes the same choices whichever thread traces it.
+static uint32_t
+raySeed(const Ray &r) {
+    uint32_t bits[6];
+    memcpy(bits, &r.orig, 3 * sizeof(float));
+    memcpy(bits + 3, &r.dir, 3 * sizeof(float));
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 6; ++i) {
+        h = (h ^ bits[i]) * 16777619u;
+    }
+    h ^= h >> 16; h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h ? h : 1;
+}
+
+static int
+strataFor(int samples) {
+    return std::max(1, (int)std::lround(std::sqrt((float)samples)));
+}
+
+static float
+luminance(const Vector3f &c) {
+    return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+void
+Renderer::renderSampled(Image &image, Image &nimage, Image &dimage) {
+    int w = _args.width;
+    int h = _args.height;
+    Filter::Kind kind = Filter::BOX;
+    if (_args.filter) {
+        Filter::parse(_args.filter_kernel, kind);
+    }
+    Film film(w, h, Filter(kind), !_args.normals_file.empty(), !_args.depth_file.empty());
+    // Wider filters add samples to pixels of the neighbouring tiles.
+    bool spread = kind != Filter::BOX;
+
+    int strata = strataFor(_args.samples);
+    forEachTile(spread, 0, h, [&](int x0, int y0, int x1, int y1) {
+        sampleTile(x0, y0, x1, y1, strata, _args.jitter, 0, NULL, film);
+    });
+
+    if (_args.adaptive_threshold > 0 && _args.adaptive_samples > 0) {
+        // Refine the pixels whose 3x3 neighbourhood varies in luminance
+        // by more than the threshold: edges, and noisy shadows and
+        // reflections.
+        std::vector<float> lum(w * h);
+        for (int y = 0; y < h; ++y) {
+            for (int x = 0; x < w; ++x) {
+                lum[y * w + x] = luminance(film.getColor(x, y));
+            }
+        }
+        std::vector<char> refine(w * h, 0);
+        int count = 0;
+        for (int y = 0; y < h; ++y) {
+            for (int x = 0; x < w; ++x) {
+                float sum = 0, sum2 = 0;
+                int n = 0;
+                for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, h - 1); ++ny) {
+                    for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, w - 1); ++nx) {
+                        float l = lum[ny * w + nx];
+                        sum += l;
+                        sum2 += l * l;
+                        n++;
+                    }
+                }
+                float mean = sum / n;
+                if (sum2 / n - mean * mean > _args.adaptive_threshold) {
+                    refine[y * w + x] = 1;
+                    count++;
+                }
+            }
+        }
+        std::cout << "Adaptive sampling: " << count << " of " << w * h
+                  << " pixels get " << _args.adaptive_samples << " more samples" << std::endl;
+
+        if (count) {
+            int extra = strataFor(_args.adaptive_samples);
+            forEachTile(spread, 0, h, [&](int x0, int y0, int x1, int y1) {
+                sampleTile(x0, y0, x1, y1, extra, _args.jitter, 1, &refine, film);
+            });
+        }
+    }
+
+    film.resolve(image, nimage, dimage);
+}
+
+void
+Renderer::sampleTile(int x0, int y0, int x1, int y1, int strata, bool jitter,
+                     int pass, const std::vector<char> *refine, Film &film) {
+    int w = _args.width;
+    int h = _args.height;
     Camera *cam = _scene.getCamera();
+    float range = (_args.depth_max - _args.depth_min);
+
+    // A pixel's samples go through the scene in packets when those are on.
+    int n = strata * strata;
+    int chunk = std::max(_packetWidth, 1);
+    std::vector<Ray> rays;
+    std::vector<Vector2f> positions;
+    rays.reserve(n);
+    positions.reserve(n);
+    RayPacket packet;
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            if (refine && !(*refine)[y * w + x]) {
+                continue;
+            }
+
+            // One sample per stratum, at its center or, with jitter, at a
+            // random spot in it.
+            uint32_t seed = pixelSeed(x, y, pass);
+            rays.clear();
+            positions.clear();
+            for (int sy = 0; sy < strata; ++sy) {
+                for (int sx = 0; sx < strata; ++sx) {
+                    float jx = 0.5f, jy = 0.5f;
+                    if (jitter) {
+                        jx = nextRandom(seed);
+                        jy = nextRandom(seed);
+                    }
+                    float px = x - 0.5f + (sx + jx) / strata;
+                    float py = y - 0.5f + (sy + jy) / strata;
+                    float ndcx = 2 * (px / (w - 1.0f)) - 1.0f;
+                    float ndcy = 2 * (py / (h - 1.0f)) - 1.0f;
+                    positions.push_back(Vector2f(px, py));
+                    rays.push_back(cam->generateRay(Vector2f(ndcx, ndcy)));
+                }
+            }
+
+            Stats::count(Stats::PRIMARY_RAYS, n);
+            for (int first = 0; first < n; first += chunk) {
+                int count = std::min(chunk, n - first);
+                Hit hits[RayPacket::MAX_SIZE];
+                int mask = 0;
+                if (_packetWidth) {
+                    packet.set(&rays[first], count);
+                    mask = _scene.getGroup()->intersectPacket(packet, cam->getTMin(), hits);
+                }
+                for (int i = 0; i < count; ++i) {
+                    const Ray &r = rays[first + i];
+                    Hit &hit = hits[i];
+                    Vector3f color;
+                    if (!_packetWidth) {
+                        color = traceRay(r, cam->getTMin(), _args.bounces, hit);
+                    } else if (mask & (1 << i)) {
+                        Stats::count(Stats::HITS);
+                        color = shade(r, hit, _args.bounces);
+                    } else {
+                        color = _scene.getBackgroundColor(r.getDirection());
+                    }
+                    Vector3f depth = range ? Vector3f((hit.t - _args.depth_min) / range) : Vector3f(0);
+                    const Vector2f &p = positions[first + i];
+                    film.addSample(p.x(), p.y(), color, (hit.getNormal() + 1.0f) / 2.0f, depth);
+                }
+            }
+        }
+    }
+}
+
+bool
+Renderer::pastDeadline() const {
+    std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - _start;
+    return elapsed.count() >= _args.time_budget;
+}
+
+// Coarsest block size of the progressive passes; divides TILE_SIZE, so
+// blocks never straddle tiles.
+static const int PROGRESSIVE_BLOCK = 8;
+
+void
+Renderer::renderProgressive(Image &image, Image &nimage, Image &dimage) {
+    int w = _args.width;
+    int h = _args.height;
+    std::atomic<int> skipped(0);
+    auto elapsed = [&]() {
+        return std::chrono::duration<float>(std::chrono::steady_clock::now() - _start).count();
+    };
+
+    // Tiles are the unit of work: a tile that has started finishes, so the
+    // deadline can be overrun by up to one tile per thread. The first pass
+    // always runs to the end so that there is something to save.
+    for (int block = PROGRESSIVE_BLOCK; block >= 1; block /= 2) {
+        bool first = block == PROGRESSIVE_BLOCK;
+        forEachTile(false, 0, h, [&](int x0, int y0, int x1, int y1) {
+            if (!first && pastDeadline()) {
+                skipped++;
+                return;
+            }
+            coarseTile(x0, y0, x1, y1, block, first, image, nimage, dimage);
+        });
+        if (skipped) {
+            std::cout << "Time budget reached in the " << block << "x" << block
+                      << " pass (" << skipped << " tiles left)" << std::endl;
+            return;
+        }
+        std::cout << "Progressive: " << block << "x" << block << " blocks done at "
+                  << elapsed() << "s" << std::endl;
+    }
+
+    // Every pixel now holds its usual one-sample color. With -samples,
+    // keep adding a jittered sample per pixel per pass.
+    if (_args.samples <= 1) {
+        return;
+    }
+    Film film(w, h, Filter(Filter::BOX), !_args.normals_file.empty(), !_args.depth_file.empty());
     for (int y = 0; y < h; ++y) {
-        float ndcy = 2 * (y / (h - 1.0f)) - 1.0f;
         for (int x = 0; x < w; ++x) {
+            film.addSample((float)x, (float)y, image.getPixel(x, y),
+                           nimage.getPixel(x, y), dimage.getPixel(x, y));
+        }
+    }
+    int samples = 1;
+    while (samples < _args.samples) {
+        forEachTile(false, 0, h, [&](int x0, int y0, int x1, int y1) {
+            if (pastDeadline()) {
+                skipped++;
+                return;
+            }
+            sampleTile(x0, y0, x1, y1, 1, true, samples, NULL, film);
+        });
+        if (skipped) {
+            std::cout << "Time budget reached in pass " << samples + 1
+                      << " (" << skipped << " tiles left)" << std::endl;
+            break;
+        }
+        samples++;
+    }
+    std::cout << "Progressive: " << samples << " samples per pixel at "
+              << elapsed() << "s" << std::endl;
+    film.resolve(image, nimage, dimage);
+}
+
+void
+Renderer::coarseTile(int x0, int y0, int x1, int y1, int block, bool first,
+                     Image &image, Image &nimage, Image &dimage) {
+    int w = _args.width;
+    int h = _args.height;
+    Camera *cam = _scene.getCamera();
+    float range = (_args.depth_max - _args.depth_min);
+    for (int y = y0; y < y1; y += block) {
+        for (int x = x0; x < x1; x += block) {
+            if (!first && x % (2 * block) == 0 && y % (2 * block) == 0) {
+                continue;
+            }
             float ndcx = 2 * (x / (w - 1.0f)) - 1.0f;
-            // Use PerspectiveCamera to generate a ray.
-            // You should understand what generateRay() does.
+            float ndcy = 2 * (y / (h - 1.0f)) - 1.0f;
             Ray r = cam->generateRay(Vector2f(ndcx, ndcy));
+            Stats::count(Stats::PRIMARY_RAYS);
+            Hit hit;
+            Vector3f color = traceRay(r, cam->getTMin(), _args.bounces, hit);
+            Vector3f normal = (hit.getNormal() + 1.0f) / 2.0f;
+            Vector3f depth = range ? Vector3f((hit.t - _args.depth_min) / range) : Vector3f(0);
+            for (int by = y; by < std::min(y + block, y1); ++by) {
+                for (int bx = x; bx < std::min(x + block, x1); ++bx) {
+                    image.setPixel(bx, by, color);
+                    nimage.setPixel(bx, by, normal);
+                    if (range) {
+                        dimage.setPixel(bx, by, depth);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void
+Renderer::renderTile(int x0, int y0, int x1, int y1,
+                     Image &image, Image &nimage, Image &dimage) {
+    int w = _args.width;
+    int h = _args.height;
+
+    // loop through all the pixels in the tile
+    // generate all the samples
 
-            Hit h;
-            Vector3f color = traceRay(r, cam->getTMin(), _args.bounces, h);
+    // This look generates camera rays and callse traceRay.
+    // It also write to the color, normal, and depth images.
+    // You should understand what this code does.
+    Camera *cam = _scene.getCamera();
 
-            image.setPixel(x, y, color);
-            nimage.setPixel(x, y, (h.getNormal() + 1.0f) / 2.0f);
-            float range = (_args.depth_max - _args.depth_min);
-            if (range) {
-                dimage.setPixel(x, y, Vector3f((h.t - _args.depth_min) / range));
+    // FINAL PROJECT
+    // With packets on, primary rays go through the scene in blocks of
+    // 4x2 (8-wide) or 2x2 (4-wide) pixels; otherwise one pixel at a time.
+    int blockW = _packetWidth == 8 ? 4 : _packetWidth == 4 ? 2 : 1;
+    int blockH = _packetWidth >= 4 ? 2 : 1;
+    std::vector<Ray> rays;
+    rays.reserve(RayPacket::MAX_SIZE);
+    RayPacket packet;
+    for (int by = y0; by < y1; by += blockH) {
+        for (int bx = x0; bx < x1; bx += blockW) {
+            rays.clear();
+            for (int y = by; y < std::min(by + blockH, y1); ++y) {
+                float ndcy = 2 * (y / (h - 1.0f)) - 1.0f;
+                for (int x = bx; x < std::min(bx + blockW, x1); ++x) {
+                    float ndcx = 2 * (x / (w - 1.0f)) - 1.0f;
+                    // Use PerspectiveCamera to generate a ray.
+                    // You should understand what generateRay() does.
+                    rays.push_back(cam->generateRay(Vector2f(ndcx, ndcy)));
+                }
+            }
+
+            Stats::count(Stats::PRIMARY_RAYS, rays.size());
+            Hit hits[RayPacket::MAX_SIZE];
+            int mask = 0;
+            if (_packetWidth) {
+                packet.set(&rays[0], (int)rays.size());
+                mask = _scene.getGroup()->intersectPacket(packet, cam->getTMin(), hits);
+            }
+
+            int i = 0;
+            for (int y = by; y < std::min(by + blockH, y1); ++y) {
+                for (int x = bx; x < std::min(bx + blockW, x1); ++x, ++i) {
+                    const Ray &r = rays[i];
+                    Hit &h = hits[i];
+                    Vector3f color;
+                    if (!_packetWidth) {
+                        color = traceRay(r, cam->getTMin(), _args.bounces, h);
+                    } else if (mask & (1 << i)) {
+                        Stats::count(Stats::HITS);
+                        color = shade(r, h, _args.bounces);
+                    } else {
+                        color = _scene.getBackgroundColor(r.getDirection());
+                    }
+
+                    image.setPixel(x, y, color);
+                    nimage.setPixel(x, y, (h.getNormal() + 1.0f) / 2.0f);
+                    float range = (_args.depth_max - _args.depth_min);
+                    if (range) {
+                        dimage.setPixel(x, y, Vector3f((h.t - _args.depth_min) / range));
+                    }
+                }
             }
         }
     }
-    // END SOLN
+}
 
-    // save the files
-    if (_args.output_file.size()) {
-        image.savePNG(_args.output_file);
+// FINAL PROJECT
+// Pixels per wave of -wavefront rendering, and rays per task in each of
+// its passes.
+static const int WAVE_SIZE = 1 << 16;
+static const int WAVE_CHUNK = 256;
+
+// The rays of one wavefront pass, as parallel arrays: ray i adds
+// weights[i] times the color it finds to pixel pixels[i] of the wave.
+struct RayQueue {
+    std::vector<Ray> rays;
+    std::vector<Vector3f> weights;
+    std::vector<int> pixels;
+
+    int size() const {
+        return (int)rays.size();
     }
-    if (_args.depth_file.size()) {
-        dimage.savePNG(_args.depth_file);
+
+    void clear() {
+        rays.clear();
+        weights.clear();
+        pixels.clear();
     }
-    if (_args.normals_file.size()) {
-        nimage.savePNG(_args.normals_file);
+
+    void push(const Ray &ray, const Vector3f &weight, int pixel) {
+        rays.push_back(ray);
+        weights.push_back(weight);
+        pixels.push_back(pixel);
+    }
+
+    void append(const RayQueue &other) {
+        rays.insert(rays.end(), other.rays.begin(), other.rays.end());
+        weights.insert(weights.end(), other.weights.begin(), other.weights.end());
+        pixels.insert(pixels.end(), other.pixels.begin(), other.pixels.end());
+    }
+};
+
+// Spreads the low 10 bits of v three bits apart, for a Morton code.
+static uint32_t
+spreadBits(uint32_t v) {
+    v = (v | v << 16) & 0x030000ffu;
+    v = (v | v << 8) & 0x0300f00fu;
+    v = (v | v << 4) & 0x030c30c3u;
+    v = (v | v << 2) & 0x09249249u;
+    return v;
+}
+
+// Reorders queue (using scratch) so that rays going into the same octant
+// from nearby origins are next to each other: the key is the direction's
+// octant followed by the Morton code of the origin on a 1024^3 grid over
+// the queue's bounds. Ties keep their order, so the result is the same
+// on every run.
+static void
+sortRays(RayQueue &queue, RayQueue &scratch) {
+    int n = queue.size();
+    Vector3f lo(std::numeric_limits<float>::max());
+    Vector3f hi(-std::numeric_limits<float>::max());
+    for (int i = 0; i < n; ++i) {
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = std::min(lo[a], queue.rays[i].orig[a]);
+            hi[a] = std::max(hi[a], queue.rays[i].orig[a]);
+        }
+    }
+    std::vector<uint64_t> keys(n);
+    for (int i = 0; i < n; ++i) {
+        const Ray &r = queue.rays[i];
+        uint32_t key = (uint32_t)r.sign[0] << 2 | (uint32_t)r.sign[1] << 1 | (uint32_t)r.sign[2];
+        uint32_t morton = 0;
+        for (int a = 0; a < 3; ++a) {
+            float extent = hi[a] - lo[a];
+            uint32_t cell = extent > 0 ? (uint32_t)std::min(1023.0f, (r.orig[a] - lo[a]) / extent * 1024) : 0;
+            morton |= spreadBits(cell) << (2 - a);
+        }
+        keys[i] = ((uint64_t)key << 30 | morton) << 31 | (uint32_t)i;
+    }
+    // Stable LSD radix sort on the 33 key bits, 11 at a time; the index
+    // below them is already in order.
+    std::vector<uint64_t> sorted(n);
+    for (int shift = 31; shift < 64; shift += 11) {
+        int offsets[2048] = {};
+        for (int i = 0; i < n; ++i) {
+            offsets[(keys[i] >> shift) & 2047]++;
+        }
+        for (int b = 0, sum = 0; b < 2048; ++b) {
+            int c = offsets[b];
+            offsets[b] = sum;
+            sum += c;
+        }
+        for (int i = 0; i < n; ++i) {
+            sorted[offsets[(keys[i] >> shift) & 2047]++] = keys[i];
+        }
+        keys.swap(sorted);
+    }
+    scratch.clear();
+    for (int i = 0; i < n; ++i) {
+        int from = (int)(keys[i] & 0x7fffffff);
+        scratch.push(queue.rays[from], queue.weights[from], queue.pixels[from]);
+    }
+    std::swap(queue, scratch);
+}
+
+// A shadow ray toward one light, and what that light adds to ray owner
+// of the queue if nothing is in the way.
+struct ShadowRay {
+    Ray ray;
+    float distToLight;
+    Vector3f light;
+    int owner;
+};
+
+void
+Renderer::renderWavefront(int y0, int y1, Image &image, Image &nimage, Image &dimage) {
+    int w = _args.width;
+    int h = _args.height;
+    Camera *cam = _scene.getCamera();
+    Group *group = _scene.getGroup();
+    float range = (_args.depth_max - _args.depth_min);
+    int numLights = _scene.getNumLights();
+
+    // Every pass below works on WAVE_CHUNK rays per task and appends what
+    // it produces to its chunk's part; parts are joined in chunk order, so
+    // the queues come out in the same order whatever the thread count.
+    std::vector<Vector3f> colors(std::min(WAVE_SIZE, w * (y1 - y0)));
+    RayQueue queue, next;
+    std::vector<RayQueue> nextParts;
+    std::vector<std::vector<ShadowRay> > shadowParts;
+    std::vector<std::vector<char> > visibleParts;
+    std::vector<Hit> hits;
+    std::vector<char> found;
+    std::vector<Vector3f> direct;
+
+    for (int first = y0 * w; first < y1 * w; first += WAVE_SIZE) {
+        int count = std::min(WAVE_SIZE, y1 * w - first);
+        int numChunks = (count + WAVE_CHUNK - 1) / WAVE_CHUNK;
+        std::fill(colors.begin(), colors.begin() + count, Vector3f(0));
+
+        // Primary rays, in scanline order.
+        nextParts.resize(numChunks);
+        _pool.parallelFor(numChunks, [&](int c) {
+            RayQueue &part = nextParts[c];
+            part.clear();
+            for (int i = c * WAVE_CHUNK; i < std::min((c + 1) * WAVE_CHUNK, count); ++i) {
+                int x = (first + i) % w;
+                int y = (first + i) / w;
+                float ndcx = 2 * (x / (w - 1.0f)) - 1.0f;
+                float ndcy = 2 * (y / (h - 1.0f)) - 1.0f;
+                part.push(cam->generateRay(Vector2f(ndcx, ndcy)), Vector3f(1), i);
+            }
+        });
+        queue.clear();
+        for (int c = 0; c < numChunks; ++c) {
+            queue.append(nextParts[c]);
+        }
+        Stats::count(Stats::PRIMARY_RAYS, count);
+
+        for (int bounce = 0; queue.size() > 0; ++bounce) {
+            int n = queue.size();
+            numChunks = (n + WAVE_CHUNK - 1) / WAVE_CHUNK;
+            float tmin = bounce ? 0.0f : cam->getTMin();
+
+            // Intersect the whole queue; primary rays go as packets of
+            // neighbouring pixels if packets are on.
+            hits.assign(n, Hit());
+            found.assign(n, 0);
+            int width = bounce == 0 ? _packetWidth : 0;
+            _pool.parallelFor(numChunks, [&](int c) {
+                int end = std::min((c + 1) * WAVE_CHUNK, n);
+                uint64_t misses = bounce ? Stats::cacheMisses() : 0;
+                RayPacket packet;
+                for (int i = c * WAVE_CHUNK; i < end; i += std::max(width, 1)) {
+                    if (width) {
+                        int size = std::min(width, end - i);
+                        packet.set(&queue.rays[i], size);
+                        int mask = group->intersectPacket(packet, tmin, &hits[i]);
+                        for (int k = 0; k < size; ++k) {
+                            found[i + k] = (mask >> k) & 1;
+                        }
+                    } else {
+                        found[i] = group->intersect(queue.rays[i], tmin, hits[i]);
+                    }
+                }
+                if (bounce) {
+                    Stats::count(Stats::SECONDARY_CACHE_MISSES, Stats::cacheMisses() - misses);
+                }
+                if (bounce == 0) {
+                    for (int i = c * WAVE_CHUNK; i < end; ++i) {
+                        int x = (first + i) % w;
+                        int y = (first + i) / w;
+                        nimage.setPixel(x, y, (hits[i].getNormal() + 1.0f) / 2.0f);
+                        if (range) {
+                            dimage.setPixel(x, y, Vector3f((hits[i].t - _args.depth_min) / range));
+                        }
+                    }
+                }
+            });
+
+            // Shade the hits: direct light without shadows, the shadow rays
+            // to test and the reflection rays for the next pass. Misses
+            // take the background.
+            direct.resize(n);
+            nextParts.resize(numChunks);
+            shadowParts.resize(numChunks);
+            _pool.parallelFor(numChunks, [&](int c) {
+                RayQueue &reflections = nextParts[c];
+                std::vector<ShadowRay> &shadows = shadowParts[c];
+                reflections.clear();
+                shadows.clear();
+                for (int i = c * WAVE_CHUNK; i < std::min((c + 1) * WAVE_CHUNK, n); ++i) {
+                    const Ray &r = queue.rays[i];
+                    const Vector3f &weight = queue.weights[i];
+                    if (!found[i]) {
+                        colors[queue.pixels[i]] += weight * _scene.getBackgroundColor(r.getDirection());
+                        continue;
+                    }
+                    Stats::count(Stats::HITS);
+                    const Hit &hit = hits[i];
+                    Vector3f I = _scene.getAmbientLight() * hit.getMaterial()->getDiffuseColor();
+                    for (int l = 0; l < numLights; ++l) {
+                        ShadowRay shadow = { r, 0, Vector3f(0), i };
+                        shadow.light = unshadowedLight(r, hit, l, shadow.ray, shadow.distToLight);
+                        if (_args.shadows) {
+                            shadows.push_back(shadow);
+                        } else {
+                            I += shadow.light;
+                        }
+                    }
+                    direct[i] = I;
+
+                    Vector3f reflected = weight;
+                    Ray reflection = r;
+                    if (bounce == _args.bounces || !reflect(r, hit, reflected, reflection)) {
+                        continue;
+                    }
+                    Stats::count(Stats::REFLECTION_RAYS);
+                    reflections.push(reflection, reflected, queue.pixels[i]);
+                }
+            });
+
+            // Shadow rays, then each hit's direct light with the lights
+            // that reached it. Each pixel has at most one ray in the queue,
+            // so the chunks add to different pixels.
+            visibleParts.resize(numChunks);
+            if (_args.shadows) {
+                _pool.parallelFor(numChunks, [&](int c) {
+                    const std::vector<ShadowRay> &shadows = shadowParts[c];
+                    std::vector<char> &visible = visibleParts[c];
+                    visible.resize(shadows.size());
+                    for (size_t s = 0; s < shadows.size(); ++s) {
+                        Stats::count(Stats::SHADOW_RAYS);
+                        visible[s] = !group->occluded(shadows[s].ray, 0, shadows[s].distToLight);
+                        if (!visible[s]) {
+                            Stats::count(Stats::HITS);
+                        }
+                    }
+                });
+            }
+            _pool.parallelFor(numChunks, [&](int c) {
+                if (_args.shadows) {
+                    const std::vector<ShadowRay> &shadows = shadowParts[c];
+                    for (size_t s = 0; s < shadows.size(); ++s) {
+                        if (visibleParts[c][s]) {
+                            direct[shadows[s].owner] += shadows[s].light;
+                        }
+                    }
+                }
+                for (int i = c * WAVE_CHUNK; i < std::min((c + 1) * WAVE_CHUNK, n); ++i) {
+                    if (found[i]) {
+                        colors[queue.pixels[i]] += queue.weights[i] * direct[i];
+                    }
+                }
+            });
+
+            next.clear();
+            for (int c = 0; c < numChunks; ++c) {
+                next.append(nextParts[c]);
+            }
+            // Each pixel still has at most one ray in the queue, so the
+            // order does not change the image.
+            if (_args.sort_rays) {
+                sortRays(next, queue);
+            }
+            std::swap(queue, next);
+        }
+
+        for (int i = 0; i < count; ++i) {
+            image.setPixel((first + i) % w, (first + i) / w, colors[i]);
+        }
     }
 }
 
@@ -74,49 +838,112 @@ Renderer::traceRay(const Ray &r,
     // The starter code only implements basic drawing of sphere primitives.
     // You will implement phong shading, recursive ray tracing, and shadow rays.
     if (_scene.getGroup()->intersect(r, tmin, h)) {
-        Vector3f I = _scene.getAmbientLight() * h.getMaterial()->getDiffuseColor();
-        Vector3f p = r.pointAtParameter(h.getT());
-        for (int i = 0; i < _scene.getNumLights(); ++i) {
-            Vector3f tolight;
-            Vector3f intensity;
-            float distToLight;
-            _scene.getLight(i)->getIllumination(p, tolight, intensity, distToLight);
-            Vector3f ILight = h.getMaterial()->shade(r, h, tolight, intensity);
-            // To compute cast shadows, you will send rays from the surface point to each
-            // light source. If an intersection is reported, and the intersection is closer
-            // than the distance to the light source, the current surface point is in shadow
-            // and direct illumination from that light source is ignored. Note that shadow
-            // rays must be sent to all light sources.
-            if (_args.shadows) {
-                Vector3f shadowRayOrigin = p + 0.05 * tolight;
-                Ray shadowRay(shadowRayOrigin, tolight);
-                Hit shadowHit = Hit();
-                Vector3f shadowTrace = traceRay(shadowRay, 0, 0, shadowHit);
-                bool shadowIntersectedSomething = shadowHit.getT() < std::numeric_limits<float>::max();
-                float distToIntersection = (shadowRay.pointAtParameter(shadowHit.getT()) - shadowRayOrigin).abs();
-                if (
-                    shadowIntersectedSomething && distToIntersection < distToLight
-                ) {
-                    ILight = Vector3f(0); // Object in shadow from this light, discount light.
-                }
-            }
-            I += ILight;
-        }
-        // Reflections.
-        if (bounces > 0) {
-            // Recursive call.
-            Vector3f V = r.getDirection();
-            Vector3f N = h.getNormal().normalized();
-            Vector3f R = (V - (2 * Vector3f::dot(V, N) * N)).normalized();
-            Hit hPrime = Hit();
-            // Add a little epsilon to avoid noise.
-            Ray rPrime(p + 0.01 * R, R);
-            Vector3f IIndirect = traceRay(rPrime, 0.0f, bounces - 1, hPrime);
-            I += (h.getMaterial()->getSpecularColor() * IIndirect);
-        }
-        return I;
+        Stats::count(Stats::HITS);
+        return shade(r, h, bounces);
     } else {
         return _scene.getBackgroundColor(r.getDirection());
     };
 }
 
+Vector3f
+Renderer::shade(const Ray &ray,
+                const Hit &hit,
+                int bounces) const {
+    // FINAL PROJECT
+    // Reflections are followed in a loop instead of by recursion; weight is
+    // the share of the next hit's color that reaches the pixel.
+    Vector3f I = directLight(ray, hit);
+    Vector3f weight(1);
+    Ray r = ray;
+    Hit h = hit;
+    for (int bounce = 0; bounce < bounces; ++bounce) {
+        if (!reflect(r, h, weight, r)) {
+            break;
+        }
+        h = Hit();
+        Stats::count(Stats::REFLECTION_RAYS);
+        if (!_scene.getGroup()->intersect(r, 0.0f, h)) {
+            I += weight * _scene.getBackgroundColor(r.getDirection());
+            break;
+        }
+        Stats::count(Stats::HITS);
+        I += weight * directLight(r, h);
+    }
+    return I;
+}
+
+Vector3f
+Renderer::directLight(const Ray &r,
+                      const Hit &h) const {
+    Vector3f I = _scene.getAmbientLight() * h.getMaterial()->getDiffuseColor();
+    for (int i = 0; i < _scene.getNumLights(); ++i) {
+        Ray shadowRay = r;
+        float distToLight;
+        Vector3f ILight = unshadowedLight(r, h, i, shadowRay, distToLight);
+        // To compute cast shadows, you will send rays from the surface point to each
+        // light source. If an intersection is reported, and the intersection is closer
+        // than the distance to the light source, the current surface point is in shadow
+        // and direct illumination from that light source is ignored. Note that shadow
+        // rays must be sent to all light sources.
+        if (_args.shadows) {
+            Stats::count(Stats::SHADOW_RAYS);
+            if (_scene.getGroup()->occluded(shadowRay, 0, distToLight)) {
+                Stats::count(Stats::HITS);
+                ILight = Vector3f(0); // Object in shadow from this light, discount light.
+            }
+        }
+        I += ILight;
+    }
+    return I;
+}
+
+Vector3f
+Renderer::unshadowedLight(const Ray &r,
+                          const Hit &h,
+                          int light,
+                          Ray &shadowRay,
+                          float &distToLight) const {
+    Vector3f p = r.pointAtParameter(h.getT());
+    Vector3f tolight;
+    Vector3f intensity;
+    _scene.getLight(light)->getIllumination(p, tolight, intensity, distToLight);
+    // FINAL PROJECT
+    // tolight is normalized, so t along the shadow ray is the distance
+    // from its origin; anything closer than the light blocks it.
+    shadowRay = Ray(p + 0.05 * tolight, tolight);
+    return h.getMaterial()->shade(r, h, tolight, intensity);
+}
+
+bool
+Renderer::reflect(const Ray &r,
+                  const Hit &h,
+                  Vector3f &weight,
+                  Ray &reflection) const {
+    // FINAL PROJECT
+    // weight is the product of the specular colors along the path; the
+    // path stops when it is too small to matter, or with -roulette at
+    // random, scaled so that the expected color stays the same.
+    Vector3f reflected = weight * h.getMaterial()->getSpecularColor();
+    float largest = std::max(reflected.x(), std::max(reflected.y(), reflected.z()));
+    if (largest <= _args.min_throughput) {
+        Stats::count(Stats::PATHS_CUT);
+        return false;
+    }
+    Vector3f V = r.getDirection();
+    Vector3f N = h.getNormal().normalized();
+    Vector3f R = (V - (2 * Vector3f::dot(V, N) * N)).normalized();
+    // Add a little epsilon to avoid noise.
+    Ray next(r.pointAtParameter(h.getT()) + 0.01 * R, R);
+    if (largest < _args.roulette) {
+        uint32_t seed = raySeed(next);
+        float survive = largest / _args.roulette;
+        if (nextRandom(seed) >= survive) {
+            Stats::count(Stats::PATHS_CUT);
+            return false;
+        }
+        reflected = reflected / survive;
+    }
+    weight = reflected;
+    reflection = next;
+    return true;
+}
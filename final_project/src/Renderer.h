@@ -1,14 +1,20 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 
+#include <chrono>
+#include <functional>
 #include <string>
+#include <vector>
 
 #include "SceneParser.h"
 #include "ArgParser.h"
+#include "ThreadPool.h"
 
 class Hit;
 class Vector3f;
 class Ray;
+class Image;
+class Film;
 
 class Renderer
 {
@@ -17,11 +23,83 @@ class Renderer
     Renderer(const ArgParser &args);
     void Render();
   private:
+    // One sample per pixel, rendered in bands of rows that are written to
+    // the output files as soon as they are done, so that only a band of
+    // each image is ever in memory.
+    void renderStreamed();
+
+    // Renders the pixels in [x0, x1) x [y0, y1) into the output images.
+    void renderTile(int x0, int y0, int x1, int y1,
+                    Image &image, Image &nimage, Image &dimage);
+
+    // Runs body(x0, y0, x1, y1) for every tile of rows [rowBegin, rowEnd)
+    // on the thread pool. With spread set the tiles go in four rounds in
+    // which no two tiles touch, for work that writes a little past the
+    // edges of its tile.
+    void forEachTile(bool spread, int rowBegin, int rowEnd,
+                     const std::function<void(int, int, int, int)> &body);
+
+    // Supersampled rendering: a first pass with _args.samples per pixel,
+    // then, with -adaptive, a second pass over the noisy pixels.
+    void renderSampled(Image &image, Image &nimage, Image &dimage);
+
+    // Adds strata x strata samples for each pixel of the tile to film,
+    // skipping pixels not set in refine (if given). With jitter the samples
+    // go to random spots in their strata, seeded by pass.
+    void sampleTile(int x0, int y0, int x1, int y1, int strata, bool jitter,
+                    int pass, const std::vector<char> *refine, Film &film);
+
+    // Progressive rendering for -time-budget: coarse blocks, then every
+    // pixel, then more samples, until the budget runs out.
+    void renderProgressive(Image &image, Image &nimage, Image &dimage);
+
+    // Traces one ray for each block x block square of the tile, at its top
+    // left pixel, and fills the square with the result. Unless first is
+    // set, squares whose pixel a pass with twice the block size already
+    // traced are left alone.
+    void coarseTile(int x0, int y0, int x1, int y1, int block, bool first,
+                    Image &image, Image &nimage, Image &dimage);
+
+    // Breadth-first rendering of rows [y0, y1) for -wavefront, one ray per
+    // pixel: all rays of a wave of pixels are intersected in one pass, then
+    // shaded in the next, then their shadow rays are tested; the
+    // reflection rays they spawn form the queue for the next round. With
+    // -sort-rays that queue is sorted by direction and origin before it is
+    // traced.
+    void renderWavefront(int y0, int y1, Image &image, Image &nimage, Image &dimage);
+
+    bool pastDeadline() const;
+
     Vector3f traceRay(const Ray &ray, float tmin, int bounces, 
                       Hit &hit) const;
 
+    // Color of a ray that hit something at hit: direct light and shadows,
+    // plus up to bounces reflections (see -min-throughput and -roulette).
+    Vector3f shade(const Ray &ray, const Hit &hit, int bounces) const;
+
+    // Ambient and direct light at hit, with shadows.
+    Vector3f directLight(const Ray &ray, const Hit &hit) const;
+
+    // What light adds at hit if nothing blocks it; shadowRay and
+    // distToLight are set to the ray that -shadows tests for that.
+    Vector3f unshadowedLight(const Ray &ray, const Hit &hit, int light,
+                             Ray &shadowRay, float &distToLight) const;
+
+    // Whether a path that reached hit along ray goes on to a reflection.
+    // If so, sets reflection to the reflected ray and multiplies weight by
+    // the share of its color that reaches the pixel.
+    bool reflect(const Ray &ray, const Hit &hit, Vector3f &weight,
+                 Ray &reflection) const;
+
     ArgParser _args;
+    // FINAL PROJECT
+    // When the renderer was created, before the scene was loaded; the
+    // -time-budget deadline counts from here.
+    std::chrono::steady_clock::time_point _start;
+    ThreadPool _pool;
     SceneParser _scene;
+    // Rays per primary packet: 8, 4, 1 (packets without SIMD) or 0 (off).
+    int _packetWidth;
 };
 
 #endif // RENDERER_H
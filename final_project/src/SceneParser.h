@@ -2,6 +2,7 @@
 #define SCENE_PARSER_H
 
 #include <cassert>
+#include <map>
 #include <vector>
 #include <vecmath.h>
 
@@ -18,7 +19,10 @@
 class SceneParser
 {
   public:
-    SceneParser(const std::string &filename);
+    // Meshes in the scene are built with the given acceleration structure,
+    // and loaded on pool if one is given.
+    SceneParser(const std::string &filename, MeshAccel accel = ACCEL_KDTREE,
+                ThreadPool *pool = NULL);
     ~SceneParser();
 
     Camera * getCamera() const {
@@ -75,7 +79,7 @@ class SceneParser
     Sphere * parseSphere();
     Plane * parsePlane();
     Triangle * parseTriangle();
-    Mesh * parseTriangleMesh();
+    Object3D * parseTriangleMesh();
     Transform * parseTransform();
     CubeMap * parseCubeMap();
 
@@ -97,6 +101,14 @@ class SceneParser
     Material * _current_material;
     Group * _group;
     CubeMap * _cubemap;
+    MeshAccel _accel;
+    ThreadPool *_pool;
+    // FINAL PROJECT
+    // Every mesh parsed so far, by file, so that a file used several
+    // times (e.g. under different Transforms) is loaded and built once and
+    // shared. Uses with another material go through a MeshInstance. Owns
+    // the meshes.
+    std::map<std::string, Mesh *> _meshes;
 };
 
 #endif // SCENE_PARSER_H
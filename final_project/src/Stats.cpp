@@ -0,0 +1,198 @@
+#include "Stats.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+bool Stats::enabled = false;
+thread_local Stats::Block *Stats::_local = NULL;
+thread_local Stats::Timer *Stats::_current = NULL;
+std::atomic<int64_t> Stats::_phaseNanos[Stats::NUM_PHASES];
+std::atomic<int> Stats::_perfState(0);
+std::mutex Stats::_blocksLock;
+std::vector<Stats::Block *> Stats::_blocks;
+
+static const char *counterNames[Stats::NUM_COUNTERS] = {
+    "primary_rays",
+    "shadow_rays",
+    "reflection_rays",
+    "hits",
+    "paths_cut",
+    "secondary_cache_misses",
+    "node_visits",
+    "leaf_visits",
+    "triangle_tests",
+    "box_tests",
+};
+
+static const char *phaseNames[Stats::NUM_PHASES] = {
+    "parse",
+    "mesh_load",
+    "accel_build",
+    "render",
+    "png_encode",
+};
+
+Stats::Block *
+Stats::registerThread() {
+    // Plain new ignores alignas before C++17, so align the block by hand.
+    size_t space = sizeof(Block) + alignof(Block);
+    void *memory = ::operator new(space);
+    _local = new (std::align(alignof(Block), sizeof(Block), memory, space)) Block();
+    std::lock_guard<std::mutex> guard(_blocksLock);
+    _blocks.push_back(_local);
+    return _local;
+}
+
+uint64_t
+Stats::cacheMisses() {
+    if (!enabled) {
+        return 0;
+    }
+    Block *block = _local ? _local : registerThread();
+#ifdef __linux__
+    if (block->perfFd == -2) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        block->perfFd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        int unused = 0;
+        if (block->perfFd >= 0) {
+            _perfState = 1;
+        } else {
+            _perfState.compare_exchange_strong(unused, -1);
+        }
+    }
+    uint64_t value;
+    if (block->perfFd >= 0) {
+        if (read(block->perfFd, &value, sizeof(value)) == sizeof(value)) {
+            return value;
+        }
+        // Give up on this thread's counter.
+        close(block->perfFd);
+    }
+#endif
+    block->perfFd = -1;
+    return 0;
+}
+
+Stats::Timer::Timer(Phase phase) :
+    _phase(phase),
+    _parent(_current),
+    _running(true),
+    _start(std::chrono::steady_clock::now()) {
+    _current = this;
+}
+
+Stats::Timer::~Timer() {
+    stop();
+}
+
+void
+Stats::Timer::stop() {
+    if (!_running) {
+        return;
+    }
+    _running = false;
+    int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - _start).count();
+    _phaseNanos[_phase] += elapsed;
+    if (_parent) {
+        _phaseNanos[_parent->_phase] -= elapsed;
+    }
+    _current = _parent;
+}
+
+void
+Stats::report(const std::string &jsonFile) {
+    // A copy of each thread's counters.
+    std::vector<std::array<uint64_t, NUM_COUNTERS> > blocks;
+    {
+        std::lock_guard<std::mutex> guard(_blocksLock);
+        for (Block *b : _blocks) {
+            blocks.push_back(std::array<uint64_t, NUM_COUNTERS>());
+            std::copy(b->counters, b->counters + NUM_COUNTERS, blocks.back().begin());
+        }
+    }
+    uint64_t total[NUM_COUNTERS] = {};
+    for (const auto &b : blocks) {
+        for (int c = 0; c < NUM_COUNTERS; ++c) {
+            total[c] += b[c];
+        }
+    }
+    // Wide enough for the longest counter or phase name.
+    int width = 0;
+    for (const char *name : counterNames) {
+        width = std::max(width, (int)strlen(name));
+    }
+    for (const char *name : phaseNames) {
+        width = std::max(width, (int)strlen(name));
+    }
+    double ms[NUM_PHASES];
+    for (int p = 0; p < NUM_PHASES; ++p) {
+        ms[p] = _phaseNanos[p] * 1e-6;
+    }
+
+    printf("Stats:\n");
+    for (int c = 0; c < NUM_COUNTERS; ++c) {
+        printf("  %-*s %14llu\n", width, counterNames[c], (unsigned long long)total[c]);
+    }
+    uint64_t rays = total[PRIMARY_RAYS] + total[SHADOW_RAYS] + total[REFLECTION_RAYS];
+    if (rays) {
+        printf("  per ray: %.2f node visits, %.2f leaf visits, %.2f triangle tests, %.2f box tests\n",
+               (double)total[NODE_VISITS] / rays, (double)total[LEAF_VISITS] / rays,
+               (double)total[TRIANGLE_TESTS] / rays, (double)total[BOX_TESTS] / rays);
+    }
+    if (_perfState < 0) {
+        printf("  (no hardware cache counters on this system)\n");
+    }
+    for (int p = 0; p < NUM_PHASES; ++p) {
+        printf("  %-*s %11.2f ms\n", width, phaseNames[p], ms[p]);
+    }
+    printf("  %-8s %14s %14s\n", "thread", "rays", "triangle_tests");
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        const uint64_t *c = blocks[i].data();
+        printf("  %-8d %14llu %14llu\n", (int)i,
+               (unsigned long long)(c[PRIMARY_RAYS] + c[SHADOW_RAYS] + c[REFLECTION_RAYS]),
+               (unsigned long long)c[TRIANGLE_TESTS]);
+    }
+
+    if (jsonFile.empty()) {
+        return;
+    }
+    std::ofstream out(jsonFile.c_str());
+    if (!out) {
+        printf("Cannot write %s\n", jsonFile.c_str());
+        return;
+    }
+    out << "{\n  \"counters\": {";
+    for (int c = 0; c < NUM_COUNTERS; ++c) {
+        out << (c ? ", " : "") << "\"" << counterNames[c] << "\": " << total[c];
+    }
+    out << "},\n  \"phases_ms\": {";
+    for (int p = 0; p < NUM_PHASES; ++p) {
+        out << (p ? ", " : "") << "\"" << phaseNames[p] << "\": " << ms[p];
+    }
+    out << "},\n  \"threads\": [";
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        out << (i ? ",\n    {" : "\n    {");
+        for (int c = 0; c < NUM_COUNTERS; ++c) {
+            out << (c ? ", " : "") << "\"" << counterNames[c] << "\": " << blocks[i][c];
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
@@ -0,0 +1,122 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// FINAL PROJECT
+// Counters and phase timers behind -stats.
+//
+// Each thread counts into its own block of counters, reached through a
+// thread_local pointer, so the hot paths never take a lock or share a
+// cache line; report() adds the blocks up. With -stats off, count() is a
+// single branch.
+//
+// Rays traced as SIMD packets count one node visit, leaf visit and
+// triangle test per packet step, not one per lane.
+//
+// cacheMisses() reads a hardware counter of the calling thread (Linux
+// perf events), for measuring the cache behaviour of one stage of the
+// renderer; it is 0 where there is no such counter.
+class Stats
+{
+public:
+    enum Counter {
+        PRIMARY_RAYS,
+        SHADOW_RAYS,
+        REFLECTION_RAYS,
+        HITS,
+        PATHS_CUT,
+        SECONDARY_CACHE_MISSES,
+        NODE_VISITS,
+        LEAF_VISITS,
+        TRIANGLE_TESTS,
+        BOX_TESTS,
+        NUM_COUNTERS
+    };
+
+    enum Phase {
+        PARSE,
+        MESH_LOAD,
+        ACCEL_BUILD,
+        RENDER,
+        PNG_ENCODE,
+        NUM_PHASES
+    };
+
+    // Adds the time between construction and stop() (or destruction) to
+    // a phase. Timers nest: time spent in an inner timer on the same
+    // thread is taken out of the outer one, so parsing a scene does not
+    // also count the meshes it loads.
+    class Timer
+    {
+    public:
+        explicit Timer(Phase phase);
+        ~Timer();
+        void stop();
+
+    private:
+        Phase _phase;
+        Timer *_parent;
+        bool _running;
+        std::chrono::steady_clock::time_point _start;
+    };
+
+    // Node and leaf visits of one traversal, kept in locals and counted
+    // once when it goes out of scope.
+    struct Visits
+    {
+        uint32_t nodes = 0;
+        uint32_t leaves = 0;
+        ~Visits() {
+            count(NODE_VISITS, nodes);
+            count(LEAF_VISITS, leaves);
+        }
+    };
+
+    static bool enabled;
+
+    static void count(Counter counter, uint64_t n = 1) {
+        if (enabled) {
+            Block *block = _local ? _local : registerThread();
+            block->counters[counter] += n;
+        }
+    }
+
+    // Cache misses of the calling thread so far, or 0 if -stats is off or
+    // the hardware counter cannot be opened (no perf events, a virtual
+    // machine without a PMU, or perf_event_paranoid too high).
+    static uint64_t cacheMisses();
+
+    // Prints a table of the totals, the phase times and each thread's
+    // share of the rays. Also writes all of it as JSON to jsonFile unless
+    // that is empty.
+    static void report(const std::string &jsonFile);
+
+private:
+    // Aligned to and padded out to whole cache lines, so that threads
+    // counting at the same time never write to the same line.
+    struct alignas(64) Block {
+        uint64_t counters[NUM_COUNTERS];
+        int perfFd = -2;    // -2: not opened yet, -1: not available
+    };
+
+    static Block *registerThread();
+
+    static thread_local Block *_local;
+    static thread_local Timer *_current;
+    static std::atomic<int64_t> _phaseNanos[NUM_PHASES];
+    // 0 until cacheMisses() is first called, then 1 if some thread could
+    // open the hardware counter and -1 if none could.
+    static std::atomic<int> _perfState;
+    // Blocks of all threads that have counted anything, in the order they
+    // started. Never freed: pool threads may count until the process exits.
+    static std::mutex _blocksLock;
+    static std::vector<Block *> _blocks;
+};
+
+#endif // STATS_H
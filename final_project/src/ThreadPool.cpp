@@ -0,0 +1,161 @@
+#include "ThreadPool.h"
+
+// Which pool (and which of its queues) the running thread belongs to.
+static thread_local const ThreadPool *t_pool = nullptr;
+static thread_local int t_queue = 0;
+
+ThreadPool::ThreadPool(int numThreads) :
+    _queued(0),
+    _stop(false)
+{
+    if (numThreads <= 0) {
+        numThreads = (int)std::thread::hardware_concurrency();
+    }
+    if (numThreads <= 0) {
+        numThreads = 1;
+    }
+    for (int i = 0; i < numThreads; ++i) {
+        _queues.push_back(new Queue());
+    }
+    // Queue 0 belongs to whoever calls into the pool from outside.
+    for (int i = 1; i < numThreads; ++i) {
+        _threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(_sleepLock);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (std::thread &t : _threads) {
+        t.join();
+    }
+    for (Queue *q : _queues) {
+        delete q;
+    }
+}
+
+int
+ThreadPool::taskDepth(int fanout) const
+{
+    int depth = 0;
+    for (long subtrees = 1; size() > 1 && subtrees < 4L * size(); subtrees *= fanout) {
+        depth++;
+    }
+    return depth;
+}
+
+int
+ThreadPool::currentQueue() const
+{
+    return t_pool == this ? t_queue : 0;
+}
+
+void
+ThreadPool::push(int queue, Task task)
+{
+    {
+        std::lock_guard<std::mutex> guard(_queues[queue]->lock);
+        _queues[queue]->tasks.push_back(std::move(task));
+    }
+    _queued++;
+    {
+        // Taking the lock orders this push against a worker that is
+        // about to go to sleep, so the wakeup cannot get lost.
+        std::lock_guard<std::mutex> guard(_sleepLock);
+    }
+    _wake.notify_one();
+}
+
+bool
+ThreadPool::pop(int self, Task &task)
+{
+    Queue *q = _queues[self];
+    std::lock_guard<std::mutex> guard(q->lock);
+    if (q->tasks.empty()) {
+        return false;
+    }
+    task = std::move(q->tasks.back());
+    q->tasks.pop_back();
+    _queued--;
+    return true;
+}
+
+bool
+ThreadPool::steal(int self, Task &task)
+{
+    int n = (int)_queues.size();
+    for (int i = 1; i < n; ++i) {
+        Queue *q = _queues[(self + i) % n];
+        std::lock_guard<std::mutex> guard(q->lock);
+        if (!q->tasks.empty()) {
+            task = std::move(q->tasks.front());
+            q->tasks.pop_front();
+            _queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+ThreadPool::helpUntil(const std::atomic<int> &remaining)
+{
+    int self = currentQueue();
+    Task task;
+    while (remaining > 0) {
+        if (pop(self, task) || steal(self, task)) {
+            task();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void
+ThreadPool::workerLoop(int id)
+{
+    t_pool = this;
+    t_queue = id;
+    Task task;
+    while (true) {
+        if (pop(id, task) || steal(id, task)) {
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(_sleepLock);
+        _wake.wait(guard, [this] { return _stop || _queued > 0; });
+        if (_stop) {
+            return;
+        }
+    }
+}
+
+void
+ThreadPool::parallelFor(int count, const std::function<void(int)> &body)
+{
+    if (count <= 0) {
+        return;
+    }
+    if (_queues.size() == 1) {
+        for (int i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+
+    std::atomic<int> remaining(count);
+    // Deal the iterations out round-robin; stealing evens out the rest.
+    int n = (int)_queues.size();
+    int first = currentQueue();
+    for (int i = 0; i < count; ++i) {
+        push((first + i) % n, [&body, &remaining, i] {
+            body(i);
+            remaining--;
+        });
+    }
+    helpUntil(remaining);
+}
@@ -0,0 +1,65 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// FINAL PROJECT
+// Small work-stealing thread pool.
+//
+// Every thread (including the one that owns the pool) has its own task
+// deque. A thread pops work from the back of its own deque and, when that
+// runs dry, steals from the front of somebody else's. A thread that waits
+// on a batch of tasks keeps executing tasks until the batch is done, so
+// tasks are allowed to spawn (and wait on) more tasks.
+class ThreadPool
+{
+public:
+    // numThreads <= 0 picks std::thread::hardware_concurrency().
+    // The calling thread counts as one of the threads.
+    explicit ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    // Total number of threads doing work, including the caller.
+    int size() const {
+        return (int)_queues.size();
+    }
+
+    // Run body(i) for every i in [0, count) and return once all are done.
+    void parallelFor(int count, const std::function<void(int)> &body);
+
+    // For recursive builds that split every node fanout ways: how many
+    // levels from the root to hand to the pool as tasks, so that there
+    // are at least four subtrees per thread. 0 with a single thread.
+    int taskDepth(int fanout) const;
+
+private:
+    typedef std::function<void()> Task;
+
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    void push(int queue, Task task);
+    bool pop(int self, Task &task);
+    bool steal(int self, Task &task);
+    void helpUntil(const std::atomic<int> &remaining);
+    void workerLoop(int id);
+    int currentQueue() const;
+
+    std::vector<Queue *> _queues;
+    std::vector<std::thread> _threads;
+
+    std::mutex _sleepLock;
+    std::condition_variable _wake;
+    std::atomic<int> _queued;
+    bool _stop;
+};
+
+#endif // THREAD_POOL_H
@@ -2,7 +2,9 @@
 #include <iostream>
 
 #include "ArgParser.h"
+#include "MeshCache.h"
 #include "Renderer.h"
+#include "Stats.h"
 
 int
 main(int argc, const char *argv[])
@@ -17,15 +19,29 @@ main(int argc, const char *argv[])
             << "\t-output <image.png>\n"
             << "\t[-depth <depth_min> <depth_max> <depth_image.png>\n]"
             << "\t[-normals <normals_image.png>]\n"
+            << "\t[-pixel-format <float|rgb8|half|rgbe>]\n"
             << "\t[-bounces <max_bounces>\n]"
             << "\t[-shadows\n]"
+            << "\t[-min-throughput <weight>] [-roulette <weight>]\n"
+            << "\t[-jitter] [-samples <n>] [-filter [gaussian|tent|box]]\n"
+            << "\t[-adaptive <variance_threshold> <extra_samples>]\n"
+            << "\t[-time-budget <seconds>]\n"
+            << "\t[-stats] [-stats-json <stats.json>]\n"
+            << "\t[-threads <num_threads>] [-packets <4|8>] [-wavefront] [-sort-rays]\n"
+            << "\t[-accel <bvh|kdtree|octree|brute>] [-cache <dir>]\n"
             << "\n"
             ;
         return 1;
     }
 
     ArgParser argsParser(argc, argv);
+    // FINAL PROJECT
+    Stats::enabled = argsParser.stats != 0;
+    MeshCache::directory = argsParser.cache_dir;
     Renderer renderer(argsParser);
     renderer.Render();
+    if (argsParser.stats) {
+        Stats::report(argsParser.stats_file);
+    }
     return 0;
 }